@@ -0,0 +1,206 @@
+/* arena.c: allocates memory that is freed all at once
+ * vim: set ts=2 sw=2 et: */
+
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/* A DfuArena hands out memory from big blocks, for data that all goes away
+ * at the same time: there is nothing to free for each allocation, and
+ * dfu_arena_reset() frees everything at once while keeping the blocks, so
+ * that an arena that is reset after each file does not allocate anything
+ * once it has grown to the size of the files. */
+
+#include <config.h>
+
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGNMENT  (2 * sizeof (gpointer))
+
+typedef struct _ArenaBlock ArenaBlock;
+
+struct _ArenaBlock {
+  ArenaBlock *next;
+  gsize       size;
+  /* the data follows, aligned on ARENA_ALIGNMENT */
+};
+
+#define ARENA_BLOCK_HEADER_SIZE \
+  ((sizeof (ArenaBlock) + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1))
+#define ARENA_BLOCK_DATA(block) ((char *) (block) + ARENA_BLOCK_HEADER_SIZE)
+
+struct _DfuArena {
+  /* blocks already used since the last reset, then free blocks */
+  ArenaBlock *blocks;
+  ArenaBlock *current;
+  char       *pos;
+  char       *end;
+};
+
+DfuArena *
+dfu_arena_new (void)
+{
+  return g_new0 (DfuArena, 1);
+}
+
+void
+dfu_arena_free (DfuArena *arena)
+{
+  ArenaBlock *block, *next;
+
+  for (block = arena->blocks; block != NULL; block = next)
+    {
+      next = block->next;
+      g_free (block);
+    }
+
+  g_free (arena);
+}
+
+/* Frees everything allocated from arena. Blocks bigger than usual, that were
+ * only needed for a big allocation, are given back to the system. */
+void
+dfu_arena_reset (DfuArena *arena)
+{
+  ArenaBlock **link;
+
+  link = &arena->blocks;
+  while (*link != NULL)
+    {
+      ArenaBlock *block = *link;
+
+      if (block->size > ARENA_BLOCK_SIZE)
+        {
+          *link = block->next;
+          g_free (block);
+        }
+      else
+        link = &block->next;
+    }
+
+  arena->current = NULL;
+  arena->pos = NULL;
+  arena->end = NULL;
+}
+
+/* Makes room for size bytes, moving to the next free block or allocating a
+ * new one. */
+static void
+arena_grow (DfuArena *arena,
+            gsize     size)
+{
+  ArenaBlock *block, *next;
+
+  next = arena->current != NULL ? arena->current->next : arena->blocks;
+
+  if (next != NULL && next->size >= size)
+    block = next;
+  else
+    {
+      gsize block_size;
+
+      block_size = MAX (size, ARENA_BLOCK_SIZE);
+      block = g_malloc (ARENA_BLOCK_HEADER_SIZE + block_size);
+      block->size = block_size;
+      block->next = next;
+
+      if (arena->current != NULL)
+        arena->current->next = block;
+      else
+        arena->blocks = block;
+    }
+
+  arena->current = block;
+  arena->pos = ARENA_BLOCK_DATA (block);
+  arena->end = arena->pos + block->size;
+}
+
+gpointer
+dfu_arena_alloc (DfuArena *arena,
+                 gsize     size)
+{
+  gsize    padding;
+  gpointer mem;
+
+  padding = -(gsize) arena->pos & (ARENA_ALIGNMENT - 1);
+  if (arena->pos == NULL || (gsize) (arena->end - arena->pos) < padding + size)
+    {
+      arena_grow (arena, size);
+      padding = 0;
+    }
+
+  mem = arena->pos + padding;
+  arena->pos += padding + size;
+
+  return mem;
+}
+
+/* Returns a block of new_size bytes starting with the old_size first bytes of
+ * mem. The last block allocated from arena grows in place, if there is room
+ * left for it. */
+gpointer
+dfu_arena_realloc (DfuArena *arena,
+                   gpointer  mem,
+                   gsize     old_size,
+                   gsize     new_size)
+{
+  gpointer new_mem;
+
+  if (mem != NULL && (char *) mem + old_size == arena->pos &&
+      (gsize) (arena->end - (char *) mem) >= new_size)
+    {
+      arena->pos = (char *) mem + new_size;
+      return mem;
+    }
+
+  new_mem = dfu_arena_alloc (arena, new_size);
+  if (mem != NULL)
+    memcpy (new_mem, mem, MIN (old_size, new_size));
+
+  return new_mem;
+}
+
+char *
+dfu_arena_strndup (DfuArena   *arena,
+                   const char *str,
+                   gsize       len)
+{
+  char *copy;
+
+  if (arena->pos == NULL || (gsize) (arena->end - arena->pos) < len + 1)
+    arena_grow (arena, len + 1);
+
+  copy = arena->pos;
+  arena->pos += len + 1;
+
+  memcpy (copy, str, len);
+  copy[len] = '\0';
+
+  return copy;
+}
+
+char *
+dfu_arena_strdup (DfuArena   *arena,
+                  const char *str)
+{
+  if (str == NULL)
+    return NULL;
+
+  return dfu_arena_strndup (arena, str, strlen (str));
+}
@@ -0,0 +1,42 @@
+/* arena.h: allocates memory that is freed all at once
+ * vim: set ts=2 sw=2 et: */
+
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#include <glib.h>
+
+typedef struct _DfuArena DfuArena;
+
+DfuArena *dfu_arena_new     (void);
+void      dfu_arena_free    (DfuArena   *arena);
+void      dfu_arena_reset   (DfuArena   *arena);
+
+gpointer  dfu_arena_alloc   (DfuArena   *arena,
+                             gsize       size);
+gpointer  dfu_arena_realloc (DfuArena   *arena,
+                             gpointer    mem,
+                             gsize       old_size,
+                             gsize       new_size);
+char     *dfu_arena_strdup  (DfuArena   *arena,
+                             const char *str);
+char     *dfu_arena_strndup (DfuArena   *arena,
+                             const char *str,
+                             gsize       len);
+
+#define dfu_arena_new_struct(arena, type) \
+  ((type *) dfu_arena_alloc ((arena), sizeof (type)))
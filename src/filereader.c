@@ -0,0 +1,951 @@
+/* filereader.c: reads batches of files with overlapping I/O
+ * vim: set ts=2 sw=2 et: */
+
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/* Reading a file with g_key_file_load_from_file() blocks on one open() and
+ * one read() at a time, which is what dominates on cold caches and network
+ * file systems. A DfuFileReader reads a whole batch of files at once, so
+ * that the I/O for these files overlaps:
+ *
+ *  - with io_uring, all the openat() of the batch are submitted together,
+ *    then, once the size of each opened file is known, all the read() of
+ *    the batch;
+ *  - with threads, each file of the batch is read by a thread of a pool;
+ *  - the sync backend reads the files one after the other, but it first
+ *    opens all the files of the batch and tells the kernel it will need
+ *    them, so that the disk reads ahead while the first files are parsed.
+ *
+ * The contents are then handed back in the order of the batch, so that the
+ * caller can parse them with g_key_file_load_from_data().
+ *
+ * With a root (see dfu_file_reader_set_root()), paths are resolved with
+ * openat2() as if the root was the root directory, including absolute
+ * symbolic links and "..". */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_OPENAT2_H
+#include <linux/openat2.h>
+#include <sys/syscall.h>
+#endif
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include <glib.h>
+
+#include "filereader.h"
+
+#define READ_THREADS 8
+
+#ifdef HAVE_IO_URING
+/* IORING_REGISTER_IOWQ_MAX_WORKERS, only known to Linux >= 5.15 headers */
+#define IO_URING_REGISTER_IOWQ_MAX_WORKERS 19
+#endif
+
+#ifndef HAVE_POSIX_FADVISE
+#define POSIX_FADV_WILLNEED 0
+#define POSIX_FADV_DONTNEED 0
+#endif
+
+#ifdef HAVE_IO_URING
+typedef struct {
+  int                  fd;
+
+  unsigned            *sq_head;
+  unsigned            *sq_tail;
+  unsigned            *sq_mask;
+  unsigned            *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned             sq_pending;
+  guint64              n_enters;
+
+  unsigned            *cq_head;
+  unsigned            *cq_tail;
+  unsigned            *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void                *sq_ring;
+  gsize                sq_ring_size;
+  void                *cq_ring;
+  gsize                cq_ring_size;
+  gsize                sqes_size;
+
+  /* state of the batch being read: results of the operations (indexed by
+   * the user_data of their sqe), file descriptors and fstat() results */
+  int                  results[DFU_FILE_READER_MAX_BATCH];
+  int                  fds[DFU_FILE_READER_MAX_BATCH];
+  int                  stat_errors[DFU_FILE_READER_MAX_BATCH];
+  struct stat          stat_bufs[DFU_FILE_READER_MAX_BATCH];
+
+#ifdef HAVE_LINUX_OPENAT2_H
+  gboolean             supports_openat2;
+  struct open_how      how;
+#endif
+} IoUring;
+#endif
+
+struct _DfuFileReader {
+  DfuFileReaderBackend  backend;
+  gboolean              drop_cache;
+  guint64               n_syscalls;
+  int                   root_fd;
+
+  GThreadPool          *pool;
+  GAsyncQueue          *done;
+
+#ifdef HAVE_IO_URING
+  IoUring              *ring;
+#endif
+};
+
+static const struct {
+  DfuFileReaderBackend  backend;
+  const char           *name;
+} backend_names[] = {
+  { DFU_FILE_READER_AUTO,     "auto" },
+  { DFU_FILE_READER_SYNC,     "sync" },
+  { DFU_FILE_READER_THREADS,  "threads" },
+  { DFU_FILE_READER_IO_URING, "io_uring" }
+};
+
+static void
+set_read_error (DfuFileRead *file,
+                int          errsv)
+{
+  g_set_error (&file->error, G_FILE_ERROR,
+               g_file_error_from_errno (errsv),
+               "%s", g_strerror (errsv));
+}
+
+static void
+set_not_regular_error (DfuFileRead *file)
+{
+  /* same error as g_key_file_load_from_file() */
+  g_set_error (&file->error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+               "Not a regular file");
+}
+
+static void
+advise (DfuFileRead *file,
+        int          fd,
+        int          advice)
+{
+#ifdef HAVE_POSIX_FADVISE
+  posix_fadvise (fd, 0, 0, advice);
+  if (file != NULL)
+    file->n_syscalls++;
+#endif
+}
+
+/* Reads the size bytes of fd into contents (of size + 1 bytes), of which
+ * the first offset bytes have already been read. Takes ownership of
+ * contents. The size given by stat() is trusted, except when it is 0, since
+ * some file systems do not know the size of their files. */
+static void
+read_contents (DfuFileRead *file,
+               int          fd,
+               char        *contents,
+               gsize        size,
+               gsize        offset)
+{
+  gboolean unknown_size;
+
+  unknown_size = (size == 0);
+
+  while (TRUE)
+    {
+      ssize_t bytes_read;
+
+      if (offset == size)
+        {
+          if (!unknown_size)
+            break;
+
+          size = size * 2 + 4096;
+          contents = g_realloc (contents, size + 1);
+        }
+
+      bytes_read = pread (fd, contents + offset, size - offset, offset);
+      file->n_syscalls++;
+
+      if (bytes_read < 0)
+        {
+          if (errno == EINTR)
+            continue;
+
+          set_read_error (file, errno);
+          g_free (contents);
+          return;
+        }
+
+      if (bytes_read == 0)
+        break;
+
+      offset += bytes_read;
+    }
+
+  contents[offset] = '\0';
+  file->contents = contents;
+  file->length = offset;
+}
+
+/* Opens path like open(), but resolving it inside root_fd if it is not -1.
+ * Returns -1 with errno set to ENOSYS if this is not supported. */
+int
+dfu_open_in_root (int         root_fd,
+                  const char *path,
+                  int         flags)
+{
+#ifdef HAVE_LINUX_OPENAT2_H
+  struct open_how how;
+#endif
+
+  if (root_fd < 0)
+    return open (path, flags);
+
+#ifdef HAVE_LINUX_OPENAT2_H
+  memset (&how, 0, sizeof (how));
+  how.flags = flags;
+  how.resolve = RESOLVE_IN_ROOT;
+
+  return syscall (__NR_openat2, root_fd, path, &how, sizeof (how));
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+static int
+open_file (DfuFileReader *reader,
+           DfuFileRead   *file)
+{
+  int fd;
+
+  /* O_NONBLOCK so that a fifo does not block us before we can tell it is
+   * not a regular file */
+  fd = dfu_open_in_root (reader->root_fd, file->path, O_RDONLY | O_NONBLOCK);
+  file->n_syscalls++;
+  if (fd < 0)
+    set_read_error (file, errno);
+
+  return fd;
+}
+
+/* Reads file from fd, and closes fd. */
+static void
+read_file_from_fd (DfuFileReader *reader,
+                   DfuFileRead   *file,
+                   int            fd)
+{
+  struct stat buf;
+
+  file->n_syscalls++;
+  if (fstat (fd, &buf) < 0)
+    set_read_error (file, errno);
+  else if (!S_ISREG (buf.st_mode))
+    set_not_regular_error (file);
+  else
+    read_contents (file, fd, g_malloc (buf.st_size + 1), buf.st_size, 0);
+
+  if (reader->drop_cache)
+    advise (file, fd, POSIX_FADV_DONTNEED);
+
+  close (fd);
+  file->n_syscalls++;
+}
+
+static void
+read_files_sync (DfuFileReader *reader,
+                 DfuFileRead   *reads,
+                 guint          n_reads)
+{
+  int fds[DFU_FILE_READER_MAX_BATCH];
+  guint i;
+
+  for (i = 0; i < n_reads; i++)
+    {
+      fds[i] = open_file (reader, &reads[i]);
+      if (fds[i] >= 0)
+        advise (&reads[i], fds[i], POSIX_FADV_WILLNEED);
+    }
+
+  for (i = 0; i < n_reads; i++)
+    {
+      if (fds[i] >= 0)
+        read_file_from_fd (reader, &reads[i], fds[i]);
+    }
+}
+
+static void
+read_file_thread (gpointer data,
+                  gpointer user_data)
+{
+  DfuFileReader *reader = user_data;
+  DfuFileRead *file = data;
+  int fd;
+
+  fd = open_file (reader, file);
+  if (fd >= 0)
+    read_file_from_fd (reader, file, fd);
+
+  g_async_queue_push (reader->done, data);
+}
+
+#ifdef HAVE_IO_URING
+static gboolean
+io_uring_supports (IoUring *ring)
+{
+  struct io_uring_probe *probe;
+  gboolean supported;
+  int ops[] = { IORING_OP_OPENAT, IORING_OP_READ };
+  guint i;
+
+  probe = g_malloc0 (sizeof (struct io_uring_probe) +
+                     256 * sizeof (struct io_uring_probe_op));
+
+  supported = syscall (__NR_io_uring_register, ring->fd,
+                       IORING_REGISTER_PROBE, probe, 256) == 0;
+
+  for (i = 0; supported && i < G_N_ELEMENTS (ops); i++)
+    supported = ops[i] <= probe->last_op &&
+                (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+
+#ifdef HAVE_LINUX_OPENAT2_H
+  ring->supports_openat2 = supported &&
+                           IORING_OP_OPENAT2 <= probe->last_op &&
+                           (probe->ops[IORING_OP_OPENAT2].flags & IO_URING_OP_SUPPORTED);
+#endif
+
+  g_free (probe);
+
+  return supported;
+}
+
+static void
+io_uring_free (IoUring *ring)
+{
+  if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+    munmap (ring->sqes, ring->sqes_size);
+  if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED &&
+      ring->cq_ring != ring->sq_ring)
+    munmap (ring->cq_ring, ring->cq_ring_size);
+  if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED)
+    munmap (ring->sq_ring, ring->sq_ring_size);
+  if (ring->fd >= 0)
+    close (ring->fd);
+
+  g_free (ring);
+}
+
+static IoUring *
+io_uring_new (GError **error)
+{
+  struct io_uring_params params;
+  IoUring *ring;
+  char *sq, *cq;
+
+  ring = g_new0 (IoUring, 1);
+
+  memset (&params, 0, sizeof (params));
+  /* an openat, then a read, for each file of a batch */
+  ring->fd = syscall (__NR_io_uring_setup, DFU_FILE_READER_MAX_BATCH,
+                      &params);
+  if (ring->fd < 0)
+    goto error;
+
+  if (!io_uring_supports (ring))
+    {
+      errno = ENOSYS;
+      goto error;
+    }
+
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+  ring->cq_ring_size = params.cq_off.cqes +
+                       params.cq_entries * sizeof (struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    ring->sq_ring_size = ring->cq_ring_size =
+      MAX (ring->sq_ring_size, ring->cq_ring_size);
+
+  ring->sq_ring = mmap (NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED)
+    goto error;
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    ring->cq_ring = ring->sq_ring;
+  else
+    {
+      ring->cq_ring = mmap (NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_CQ_RING);
+      if (ring->cq_ring == MAP_FAILED)
+        goto error;
+    }
+
+  ring->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+  ring->sqes = mmap (NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+    goto error;
+
+  sq = ring->sq_ring;
+  ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+
+  cq = ring->cq_ring;
+  ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+  return ring;
+
+error:
+  g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+               "Cannot use io_uring: %s", g_strerror (errno));
+  io_uring_free (ring);
+
+  return NULL;
+}
+
+static struct io_uring_sqe *
+io_uring_get_sqe (IoUring *ring)
+{
+  struct io_uring_sqe *sqe;
+  unsigned index;
+
+  index = (*ring->sq_tail + ring->sq_pending) & *ring->sq_mask;
+  ring->sq_array[index] = index;
+  ring->sq_pending++;
+
+  sqe = &ring->sqes[index];
+  memset (sqe, 0, sizeof (*sqe));
+
+  return sqe;
+}
+
+/* Submits the pending sqes and waits for all of them to complete, storing
+ * the result of each one in results[user_data]. Returns FALSE if some sqes
+ * could not be submitted: their results are left as they were, and the
+ * sqes that were submitted have completed. */
+static gboolean
+io_uring_submit_and_wait (IoUring *ring,
+                          int     *results)
+{
+  unsigned to_submit, to_complete, head;
+  gboolean submitted_all;
+
+  to_submit = to_complete = ring->sq_pending;
+  __atomic_store_n (ring->sq_tail, *ring->sq_tail + ring->sq_pending,
+                    __ATOMIC_RELEASE);
+  ring->sq_pending = 0;
+  submitted_all = TRUE;
+
+  while (to_complete > 0)
+    {
+      unsigned tail;
+      int ret;
+
+      ret = syscall (__NR_io_uring_enter, ring->fd, to_submit, 1,
+                     IORING_ENTER_GETEVENTS, NULL, 0);
+      ring->n_enters++;
+      if (ret < 0)
+        {
+          if (errno == EINTR)
+            continue;
+
+          /* on EAGAIN or EBUSY, the completion queue is full or the kernel
+           * is short of memory: drain the queue below before trying again */
+          if (errno != EAGAIN && errno != EBUSY)
+            {
+              if (to_submit > 0)
+                {
+                  /* io_uring_enter() only fails when it submitted nothing:
+                   * give the sqes that are left back, and wait for the
+                   * others, which are still using their buffers */
+                  __atomic_store_n (ring->sq_tail,
+                                    *ring->sq_tail - to_submit,
+                                    __ATOMIC_RELEASE);
+                  to_complete -= to_submit;
+                  to_submit = 0;
+                  submitted_all = FALSE;
+                }
+              else
+                /* waiting failed: the completions still come, look for
+                 * them without the kernel's help */
+                g_usleep (1000);
+            }
+        }
+      else
+        to_submit -= MIN ((unsigned) ret, to_submit);
+
+      head = *ring->cq_head;
+      tail = __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE);
+
+      for (; head != tail; head++)
+        {
+          struct io_uring_cqe *cqe;
+
+          cqe = &ring->cqes[head & *ring->cq_mask];
+          results[cqe->user_data] = cqe->res;
+          to_complete--;
+        }
+
+      __atomic_store_n (ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+  return submitted_all;
+}
+
+/* Returns FALSE if io_uring could not be used for this batch, in which case
+ * nothing has been read. */
+static gboolean
+read_files_io_uring (DfuFileReader *reader,
+                     DfuFileRead   *reads,
+                     guint          n_reads)
+{
+  IoUring *ring = reader->ring;
+  char *contents[DFU_FILE_READER_MAX_BATCH];
+  guint i;
+
+  /* first step: open all the files; with a root, paths are resolved inside
+   * it with openat2() */
+#ifdef HAVE_LINUX_OPENAT2_H
+  if (reader->root_fd >= 0)
+    {
+      if (!ring->supports_openat2)
+        return FALSE;
+
+      memset (&ring->how, 0, sizeof (ring->how));
+      ring->how.flags = O_RDONLY | O_NONBLOCK;
+      ring->how.resolve = RESOLVE_IN_ROOT;
+    }
+#else
+  if (reader->root_fd >= 0)
+    return FALSE;
+#endif
+
+  for (i = 0; i < n_reads; i++)
+    {
+      struct io_uring_sqe *sqe;
+
+      sqe = io_uring_get_sqe (ring);
+#ifdef HAVE_LINUX_OPENAT2_H
+      if (reader->root_fd >= 0)
+        {
+          sqe->opcode = IORING_OP_OPENAT2;
+          sqe->fd = reader->root_fd;
+          sqe->len = sizeof (ring->how);
+          sqe->off = (guint64) (gsize) &ring->how;
+        }
+      else
+#endif
+        {
+          sqe->opcode = IORING_OP_OPENAT;
+          sqe->fd = AT_FDCWD;
+          sqe->open_flags = O_RDONLY | O_NONBLOCK;
+        }
+      sqe->addr = (guint64) (gsize) reads[i].path;
+      sqe->user_data = i;
+
+      ring->results[i] = -ECANCELED;
+    }
+
+  if (!io_uring_submit_and_wait (ring, ring->results))
+    {
+      /* the whole batch is read again without io_uring */
+      for (i = 0; i < n_reads; i++)
+        {
+          if (ring->results[i] >= 0)
+            close (ring->results[i]);
+        }
+
+      return FALSE;
+    }
+
+  /* the size is the one of the file that was opened, which is not always
+   * the one found at its path a moment before or after */
+  for (i = 0; i < n_reads; i++)
+    {
+      ring->fds[i] = ring->results[i];
+      ring->stat_errors[i] = 0;
+
+      if (ring->fds[i] < 0)
+        continue;
+
+      reads[i].n_syscalls++;
+      if (fstat (ring->fds[i], &ring->stat_bufs[i]) < 0)
+        ring->stat_errors[i] = errno;
+    }
+
+  /* second step: read the regular files */
+  for (i = 0; i < n_reads; i++)
+    {
+      struct stat *buf = &ring->stat_bufs[i];
+      struct io_uring_sqe *sqe;
+
+      ring->results[i] = 0;
+      contents[i] = NULL;
+
+      if (ring->fds[i] < 0)
+        {
+          set_read_error (&reads[i], -ring->fds[i]);
+          continue;
+        }
+
+      if (ring->stat_errors[i] != 0)
+        set_read_error (&reads[i], ring->stat_errors[i]);
+      else if (!S_ISREG (buf->st_mode))
+        set_not_regular_error (&reads[i]);
+
+      if (reads[i].error != NULL)
+        {
+          close (ring->fds[i]);
+          reads[i].n_syscalls++;
+          ring->fds[i] = -1;
+          continue;
+        }
+
+      contents[i] = g_malloc (buf->st_size + 1);
+
+      if (buf->st_size == 0 || buf->st_size > G_MAXINT)
+        continue;
+
+      sqe = io_uring_get_sqe (ring);
+      sqe->opcode = IORING_OP_READ;
+      sqe->fd = ring->fds[i];
+      sqe->addr = (guint64) (gsize) contents[i];
+      sqe->len = buf->st_size;
+      sqe->off = 0;
+      sqe->user_data = i;
+    }
+
+  /* the reads that cannot be submitted keep a result of 0, and
+   * read_contents() reads all of these files */
+  io_uring_submit_and_wait (ring, ring->results);
+
+  for (i = 0; i < n_reads; i++)
+    {
+      gsize size;
+      int res;
+
+      if (ring->fds[i] < 0)
+        continue;
+
+      size = ring->stat_bufs[i].st_size;
+      res = ring->results[i];
+
+      if (res < 0)
+        {
+          set_read_error (&reads[i], -res);
+          g_free (contents[i]);
+        }
+      else if ((gsize) res == size && size > 0)
+        {
+          contents[i][size] = '\0';
+          reads[i].contents = contents[i];
+          reads[i].length = size;
+        }
+      else
+        /* short read, or unknown size */
+        read_contents (&reads[i], ring->fds[i], contents[i], size, res);
+
+      if (reader->drop_cache)
+        advise (&reads[i], ring->fds[i], POSIX_FADV_DONTNEED);
+
+      close (ring->fds[i]);
+      reads[i].n_syscalls++;
+    }
+
+  return TRUE;
+}
+#endif
+
+DfuFileReader *
+dfu_file_reader_new (DfuFileReaderBackend   backend,
+                     GError               **error)
+{
+  DfuFileReader *reader;
+  GError *new_error;
+
+  reader = g_new0 (DfuFileReader, 1);
+  reader->root_fd = -1;
+  new_error = NULL;
+
+#ifdef HAVE_IO_URING
+  if (backend == DFU_FILE_READER_AUTO || backend == DFU_FILE_READER_IO_URING)
+    {
+      reader->ring = io_uring_new (&new_error);
+
+      if (reader->ring != NULL)
+        {
+          reader->backend = DFU_FILE_READER_IO_URING;
+          return reader;
+        }
+
+      if (backend == DFU_FILE_READER_IO_URING)
+        goto error;
+
+      g_clear_error (&new_error);
+    }
+#else
+  if (backend == DFU_FILE_READER_IO_URING)
+    {
+      g_set_error (&new_error, G_FILE_ERROR, G_FILE_ERROR_NOSYS,
+                   "Cannot use io_uring: not supported on this system");
+      goto error;
+    }
+#endif
+
+  if (backend == DFU_FILE_READER_AUTO || backend == DFU_FILE_READER_THREADS)
+    {
+#if !GLIB_CHECK_VERSION (2, 32, 0)
+      if (!g_thread_supported ())
+        g_thread_init (NULL);
+#endif
+
+      reader->pool = g_thread_pool_new (read_file_thread, reader,
+                                        READ_THREADS, FALSE, &new_error);
+
+      if (reader->pool != NULL)
+        {
+          reader->done = g_async_queue_new ();
+          reader->backend = DFU_FILE_READER_THREADS;
+          return reader;
+        }
+
+      if (backend == DFU_FILE_READER_THREADS)
+        goto error;
+
+      g_clear_error (&new_error);
+    }
+
+  reader->backend = DFU_FILE_READER_SYNC;
+
+  return reader;
+
+error:
+  g_propagate_error (error, new_error);
+  g_free (reader);
+
+  return NULL;
+}
+
+void
+dfu_file_reader_free (DfuFileReader *reader)
+{
+  if (reader == NULL)
+    return;
+
+  if (reader->pool != NULL)
+    g_thread_pool_free (reader->pool, FALSE, TRUE);
+  if (reader->done != NULL)
+    g_async_queue_unref (reader->done);
+#ifdef HAVE_IO_URING
+  if (reader->ring != NULL)
+    io_uring_free (reader->ring);
+#endif
+
+  g_free (reader);
+}
+
+DfuFileReaderBackend
+dfu_file_reader_get_backend (DfuFileReader *reader)
+{
+  return reader->backend;
+}
+
+/* Limits the number of threads reading files at the same time. With
+ * io_uring, this limits the number of kernel workers used for the reads
+ * that cannot be done without blocking, if the kernel supports it. */
+void
+dfu_file_reader_set_max_workers (DfuFileReader *reader,
+                                 guint          max_workers)
+{
+  g_return_if_fail (max_workers > 0);
+
+  if (reader->pool != NULL)
+    g_thread_pool_set_max_threads (reader->pool, max_workers, NULL);
+
+#ifdef HAVE_IO_URING
+  if (reader->ring != NULL)
+    {
+      /* bounded and unbounded workers */
+      unsigned int values[2] = { max_workers, max_workers };
+
+      syscall (__NR_io_uring_register, reader->ring->fd,
+               IO_URING_REGISTER_IOWQ_MAX_WORKERS, values, 2);
+    }
+#endif
+}
+
+/* Tells the kernel to drop the files from the page cache once they have
+ * been read, for callers that know they will not be read again soon. */
+void
+dfu_file_reader_set_drop_cache (DfuFileReader *reader,
+                                gboolean       drop_cache)
+{
+  reader->drop_cache = drop_cache;
+}
+
+/* Makes the paths of the files to read relative to root_fd, which stays
+ * owned by the caller; -1 resolves them as usual. */
+void
+dfu_file_reader_set_root (DfuFileReader *reader,
+                          int            root_fd)
+{
+  reader->root_fd = root_fd;
+}
+
+static void
+advise_path (const char *path,
+             int         advice)
+{
+#ifdef HAVE_POSIX_FADVISE
+  int fd;
+
+  fd = open (path, O_RDONLY | O_NONBLOCK);
+  if (fd < 0)
+    return;
+
+  advise (NULL, fd, advice);
+  close (fd);
+#endif
+}
+
+/* For callers reading files without a DfuFileReader: tells the kernel that
+ * path will be read soon, so that it can start reading it in the
+ * background. */
+void
+dfu_file_advise_will_need (const char *path)
+{
+  advise_path (path, POSIX_FADV_WILLNEED);
+}
+
+/* Tells the kernel that path will not be read again soon. */
+void
+dfu_file_advise_dont_need (const char *path)
+{
+  advise_path (path, POSIX_FADV_DONTNEED);
+}
+
+gboolean
+dfu_file_reader_backend_from_string (const char           *name,
+                                     DfuFileReaderBackend *backend)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (backend_names); i++)
+    {
+      if (strcmp (name, backend_names[i].name) == 0)
+        {
+          *backend = backend_names[i].backend;
+          return TRUE;
+        }
+    }
+
+  return FALSE;
+}
+
+const char *
+dfu_file_reader_backend_to_string (DfuFileReaderBackend backend)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (backend_names); i++)
+    {
+      if (backend_names[i].backend == backend)
+        return backend_names[i].name;
+    }
+
+  return NULL;
+}
+
+/* Reads the n_reads (at most DFU_FILE_READER_MAX_BATCH) files of reads. For
+ * each of them, either contents or error is set. */
+void
+dfu_file_reader_read (DfuFileReader *reader,
+                      DfuFileRead   *reads,
+                      guint          n_reads)
+{
+  guint i;
+
+  g_return_if_fail (n_reads <= DFU_FILE_READER_MAX_BATCH);
+
+  for (i = 0; i < n_reads; i++)
+    {
+      reads[i].contents = NULL;
+      reads[i].length = 0;
+      reads[i].error = NULL;
+      reads[i].n_syscalls = 0;
+    }
+
+  switch (reader->backend)
+    {
+#ifdef HAVE_IO_URING
+      case DFU_FILE_READER_IO_URING:
+        if (read_files_io_uring (reader, reads, n_reads))
+          break;
+        /* not a break: read this batch synchronously */
+#endif
+      case DFU_FILE_READER_SYNC:
+        read_files_sync (reader, reads, n_reads);
+        break;
+
+      case DFU_FILE_READER_THREADS:
+        for (i = 0; i < n_reads; i++)
+          g_thread_pool_push (reader->pool, &reads[i], NULL);
+        for (i = 0; i < n_reads; i++)
+          g_async_queue_pop (reader->done);
+        break;
+
+      default:
+        g_assert_not_reached ();
+    }
+
+  for (i = 0; i < n_reads; i++)
+    reader->n_syscalls += reads[i].n_syscalls;
+}
+
+/* Returns the number of system calls made so far to read files. */
+guint64
+dfu_file_reader_get_n_syscalls (DfuFileReader *reader)
+{
+#ifdef HAVE_IO_URING
+  if (reader->ring != NULL)
+    return reader->n_syscalls + reader->ring->n_enters;
+#endif
+
+  return reader->n_syscalls;
+}
+
@@ -0,0 +1,73 @@
+/* filereader.h: reads batches of files with overlapping I/O
+ * vim: set ts=2 sw=2 et: */
+
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#include <glib.h>
+
+/* Maximum number of files given to dfu_file_reader_read() at once */
+#define DFU_FILE_READER_MAX_BATCH 64
+
+typedef enum {
+  DFU_FILE_READER_AUTO,
+  DFU_FILE_READER_SYNC,
+  DFU_FILE_READER_THREADS,
+  DFU_FILE_READER_IO_URING
+} DfuFileReaderBackend;
+
+typedef struct {
+  const char *path;
+
+  /* set by dfu_file_reader_read(): either contents (nul-terminated, to be
+   * freed with g_free()) or error */
+  char       *contents;
+  gsize       length;
+  GError     *error;
+
+  /* number of system calls made to read this file */
+  guint       n_syscalls;
+} DfuFileRead;
+
+typedef struct _DfuFileReader DfuFileReader;
+
+DfuFileReader        *dfu_file_reader_new         (DfuFileReaderBackend   backend,
+                                                   GError               **error);
+void                  dfu_file_reader_free        (DfuFileReader         *reader);
+
+DfuFileReaderBackend  dfu_file_reader_get_backend (DfuFileReader         *reader);
+void                  dfu_file_reader_set_drop_cache (DfuFileReader      *reader,
+                                                      gboolean            drop_cache);
+void                  dfu_file_reader_set_max_workers (DfuFileReader     *reader,
+                                                       guint              max_workers);
+void                  dfu_file_reader_set_root    (DfuFileReader         *reader,
+                                                   int                    root_fd);
+gboolean              dfu_file_reader_backend_from_string (const char           *name,
+                                                           DfuFileReaderBackend *backend);
+const char           *dfu_file_reader_backend_to_string   (DfuFileReaderBackend  backend);
+
+void                  dfu_file_reader_read        (DfuFileReader         *reader,
+                                                   DfuFileRead           *reads,
+                                                   guint                  n_reads);
+guint64               dfu_file_reader_get_n_syscalls (DfuFileReader      *reader);
+
+int                   dfu_open_in_root            (int                    root_fd,
+                                                   const char            *path,
+                                                   int                    flags);
+
+void                  dfu_file_advise_will_need   (const char            *path);
+void                  dfu_file_advise_dont_need   (const char            *path);
@@ -47,6 +47,7 @@ static char *vendor_name = NULL;
 static char *target_dir = NULL;
 static GSList *edit_actions = NULL;
 static mode_t permissions = 0644;
+static DfuValidator *validator = NULL;
 
 typedef enum
 {
@@ -248,7 +249,7 @@ process_one_file (const char *filename,
   g_key_file_free (kf);
 
   /* Load and validate the file we just wrote */
-  if (!desktop_file_validate (new_filename, FALSE, TRUE, TRUE))
+  if (!dfu_validator_validate_file (validator, new_filename))
     {
       g_set_error (err, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_PARSE,
                    _("Failed to validate the created desktop file"));
@@ -926,6 +927,10 @@ main (int argc, char **argv)
         }
     }
 
+  validator = dfu_validator_new ();
+  dfu_validator_set_no_warn_deprecated (validator, TRUE);
+  dfu_validator_set_no_hints (validator, TRUE);
+
   for (i = 0; args && args[i]; i++)
     {
       err = NULL;
@@ -940,6 +945,8 @@ main (int argc, char **argv)
         }
     }
 
+  dfu_validator_free (validator);
+
 #if GLIB_CHECK_VERSION(2,28,0)
   g_slist_free_full (edit_actions, (GDestroyNotify) dfu_edit_action_free);
 #else
@@ -159,37 +159,189 @@ dfu_key_file_copy_key (GKeyFile   *keyfile,
   return TRUE;
 }
 
+void
+dfu_list_iter_init (DfuListIter *iter,
+                    const char  *value)
+{
+  iter->next = value;
+}
+
+gboolean
+dfu_list_iter_next (DfuListIter  *iter,
+                    const char  **item,
+                    gsize        *len)
+{
+  const char *p;
+
+  if (*iter->next == '\0')
+    return FALSE;
+
+  for (p = iter->next; *p != '\0' && *p != ';'; p++) {
+    if (*p == '\\' && p[1] != '\0')
+      p++;
+  }
+
+  *item = iter->next;
+  *len = p - iter->next;
+
+  iter->next = (*p == ';') ? p + 1 : p;
+
+  return TRUE;
+}
+
+void
+dfu_list_set_init (DfuListSet *set)
+{
+  set->slots = set->stack_slots;
+  set->size = DFU_LIST_SET_STACK_SIZE;
+  set->n_items = 0;
+  memset (set->stack_slots, 0, sizeof (set->stack_slots));
+}
+
+void
+dfu_list_set_clear (DfuListSet *set)
+{
+  if (set->slots != set->stack_slots)
+    g_free (set->slots);
+
+  dfu_list_set_init (set);
+}
+
+static guint
+list_item_hash (const char *item,
+                gsize       len)
+{
+  guint hash;
+  gsize i;
+
+  hash = 5381;
+  for (i = 0; i < len; i++)
+    hash = (hash << 5) + hash + (guchar) item[i];
+
+  return hash;
+}
+
+static void
+list_set_grow (DfuListSet *set)
+{
+  DfuListSetSlot *old_slots;
+  guint           old_size;
+  guint           i;
+
+  old_slots = set->slots;
+  old_size = set->size;
+
+  set->size *= 2;
+  set->slots = g_new0 (DfuListSetSlot, set->size);
+
+  for (i = 0; i < old_size; i++) {
+    guint j;
+
+    if (old_slots[i].item == NULL)
+      continue;
+
+    j = list_item_hash (old_slots[i].item, old_slots[i].len) & (set->size - 1);
+    while (set->slots[j].item != NULL)
+      j = (j + 1) & (set->size - 1);
+
+    set->slots[j] = old_slots[i];
+  }
+
+  if (old_slots != set->stack_slots)
+    g_free (old_slots);
+}
+
+/* Returns FALSE if item was already in set */
+gboolean
+dfu_list_set_add (DfuListSet *set,
+                  const char *item,
+                  gsize       len)
+{
+  guint i;
+
+  /* keep at least half of the slots empty */
+  if ((set->n_items + 1) * 2 > set->size)
+    list_set_grow (set);
+
+  for (i = list_item_hash (item, len) & (set->size - 1);
+       set->slots[i].item != NULL;
+       i = (i + 1) & (set->size - 1)) {
+    if (set->slots[i].len == len && !memcmp (set->slots[i].item, item, len))
+      return FALSE;
+  }
+
+  set->slots[i].item = item;
+  set->slots[i].len = len;
+  set->n_items++;
+
+  return TRUE;
+}
+
+/* Whether the escaped item, of len bytes, is str once unescaped as
+ * g_key_file_get_string_list() does */
+static gboolean
+list_item_equal (const char *item,
+                 gsize       len,
+                 const char *str)
+{
+  const char *end;
+
+  for (end = item + len; item < end; item++, str++) {
+    char c = *item;
+
+    if (c == '\\' && item + 1 < end) {
+      switch (item[1]) {
+        case 's':  c = ' ';  break;
+        case 'n':  c = '\n'; break;
+        case 't':  c = '\t'; break;
+        case 'r':  c = '\r'; break;
+        case ';':  c = ';';  break;
+        case '\\': c = '\\'; break;
+        default:   c = '\0'; break;
+      }
+
+      if (c != '\0')
+        item++;
+      else
+        c = '\\';
+    }
+
+    if (*str != c)
+      return FALSE;
+  }
+
+  return *str == '\0';
+}
+
 void
 dfu_key_file_merge_list (GKeyFile   *keyfile,
                          const char *group,
                          const char *key,
                          const char *to_merge)
 {
-  char **values;
-  char  *value;
-  char  *str;
-  int    i;
+  DfuListIter  iter;
+  const char  *item;
+  gsize        len;
+  char        *value;
+  char        *str;
 
   g_return_if_fail (keyfile != NULL);
 
-  values = g_key_file_get_string_list (keyfile, group, key, NULL, NULL);
+  value = g_key_file_get_value (keyfile, group, key, NULL);
+
+  if (value) {
+    size_t value_len;
 
-  if (values) {
-    for (i = 0; values[i] != NULL; i++) {
-      if (!strcmp (values[i], to_merge)) {
-        g_strfreev (values);
+    dfu_list_iter_init (&iter, value);
+    while (dfu_list_iter_next (&iter, &item, &len)) {
+      if (list_item_equal (item, len, to_merge)) {
+        g_free (value);
         return;
       }
     }
 
-    g_strfreev (values);
-  }
-
-  value = g_key_file_get_value (keyfile, group, key, NULL);
-
-  if (value) {
-    size_t len = strlen (value);
-    if (len > 0 && value[len - 1] != ';') {
+    value_len = strlen (value);
+    if (value_len > 0 && value[value_len - 1] != ';') {
       str = g_strconcat (value, ";", to_merge, ";", NULL);
     } else {
       str = g_strconcat (value, to_merge, ";", NULL);
@@ -209,35 +361,40 @@ dfu_key_file_remove_list (GKeyFile   *keyfile,
                           const char *key,
                           const char *to_remove)
 {
-  char     **values;
-  GString   *value;
-  gboolean   found;
-  int        i;
+  DfuListIter  iter;
+  const char  *item;
+  gsize        len;
+  char        *old_value;
+  GString     *value;
+  gboolean     found;
 
   g_return_if_fail (keyfile != NULL);
 
-  found = FALSE;
-
-  value  = g_string_new ("");
-  values = g_key_file_get_string_list (keyfile, group, key, NULL, NULL);
+  old_value = g_key_file_get_value (keyfile, group, key, NULL);
+  if (!old_value)
+    return;
 
-  if (values) {
-    for (i = 0; values[i] != NULL; i++) {
-      if (!strcmp (values[i], to_remove))
-        found = TRUE;
-      else
-        g_string_append_printf (value, "%s;", values[i]);
+  found = FALSE;
+  value = g_string_new ("");
+
+  dfu_list_iter_init (&iter, old_value);
+  while (dfu_list_iter_next (&iter, &item, &len)) {
+    if (list_item_equal (item, len, to_remove))
+      found = TRUE;
+    else {
+      g_string_append_len (value, item, len);
+      g_string_append_c (value, ';');
     }
-
-    g_strfreev (values);
   }
 
+  g_free (old_value);
+
   if (!found) {
     g_string_free (value, TRUE);
     return;
   }
 
-  if (!value->str || value->str[0] == '\0')
+  if (value->str[0] == '\0')
     g_key_file_remove_key (keyfile, group, key, NULL);
   else
     g_key_file_set_value (keyfile, group, key, value->str);
@@ -24,6 +24,43 @@
 
 #define GROUP_DESKTOP_ENTRY "Desktop Entry"
 
+/* Iterates over the items of a list value without copying them. As with
+ * g_key_file_get_string_list(), an escaped separator ("\;") does not end
+ * an item, and there is no empty item after the last separator; items are
+ * returned as they appear in the value, still escaped. */
+typedef struct {
+  const char *next;
+} DfuListIter;
+
+typedef struct {
+  const char *item;
+  gsize       len;
+} DfuListSetSlot;
+
+#define DFU_LIST_SET_STACK_SIZE 32
+
+/* Set of list items, to find duplicated items: it is an open-addressing hash
+ * table whose slots are in the structure itself until it holds more than
+ * half of DFU_LIST_SET_STACK_SIZE items, so that it can live on the stack */
+typedef struct {
+  DfuListSetSlot *slots;
+  guint           size;
+  guint           n_items;
+  DfuListSetSlot  stack_slots[DFU_LIST_SET_STACK_SIZE];
+} DfuListSet;
+
+void     dfu_list_iter_init  (DfuListIter  *iter,
+                              const char   *value);
+gboolean dfu_list_iter_next  (DfuListIter  *iter,
+                              const char  **item,
+                              gsize        *len);
+
+void     dfu_list_set_init   (DfuListSet   *set);
+gboolean dfu_list_set_add    (DfuListSet   *set,
+                              const char   *item,
+                              gsize         len);
+void     dfu_list_set_clear  (DfuListSet   *set);
+
 gboolean dfu_key_file_rename_group (GKeyFile   *keyfile,
                                     const char *oldgroup,
                                     const char *newgroup);
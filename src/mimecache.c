@@ -0,0 +1,376 @@
+/* mimecache.c: read-only access to mimeinfo.cache files
+ * vim: set ts=2 sw=2 et: */
+
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/* The cache is mapped in memory and never copied: update-desktop-database
+ * writes the keys of each group sorted with strcmp(), so a lookup is a binary
+ * search over the lines of the group, and the returned value points into the
+ * mapping. This only works with files written by update-desktop-database; a
+ * hand-edited cache that is not sorted anymore will give wrong results.
+ *
+ * When the cache starts with a header, its checksum is verified once, when
+ * the cache is opened, so that a cache truncated or damaged after it was
+ * written is not used. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "mimecache.h"
+
+typedef struct {
+  const char *start;
+  const char *end;
+} MimeCacheGroup;
+
+struct _DfuMimeCache {
+  char           *data;
+  gsize           length;
+
+  MimeCacheGroup  mime_types;
+  MimeCacheGroup  desktop_ids;
+};
+
+/* Finds the next group header at or after p, ie a '[' starting a line. */
+static const char *
+find_group_header (const char *data,
+                   const char *p,
+                   const char *end)
+{
+  while (p < end) {
+    p = memchr (p, '[', end - p);
+    if (p == NULL)
+      return NULL;
+
+    if (p == data || p[-1] == '\n')
+      return p;
+
+    p++;
+  }
+
+  return NULL;
+}
+
+/* Finds the body of group "[name]", ie the lines between its header and the
+ * next group header (or the end of the file). */
+static gboolean
+find_group (const char     *data,
+            gsize           length,
+            const char     *name,
+            MimeCacheGroup *group)
+{
+  const char *end;
+  const char *line;
+  const char *next;
+  gsize       name_len;
+
+  end = data + length;
+  name_len = strlen (name);
+
+  for (line = find_group_header (data, data, end);
+       line != NULL;
+       line = find_group_header (data, line + 1, end)) {
+    next = memchr (line, '\n', end - line);
+    if (next == NULL)
+      next = end;
+
+    if ((gsize) (next - line) == name_len + 2 &&
+        memcmp (line + 1, name, name_len) == 0 && line[name_len + 1] == ']')
+      break;
+  }
+
+  if (line == NULL)
+    return FALSE;
+
+  group->start = MIN (next + 1, end);
+  group->end = find_group_header (data, group->start, end);
+  if (group->end == NULL)
+    group->end = end;
+
+  return TRUE;
+}
+
+static int
+compare_key (const char *key,
+             const char *line_key,
+             gsize       line_key_len)
+{
+  gsize key_len;
+  int   cmp;
+
+  key_len = strlen (key);
+  cmp = memcmp (key, line_key, MIN (key_len, line_key_len));
+
+  if (cmp != 0)
+    return cmp;
+
+  if (key_len == line_key_len)
+    return 0;
+
+  return key_len < line_key_len ? -1 : 1;
+}
+
+static gboolean
+lookup_in_group (const MimeCacheGroup  *group,
+                 const char            *key,
+                 const char           **value,
+                 gsize                 *length)
+{
+  const char *lo;
+  const char *hi;
+
+  lo = group->start;
+  hi = group->end;
+
+  while (lo < hi) {
+    const char *mid;
+    const char *line;
+    const char *line_end;
+    const char *equal;
+    int         cmp;
+
+    mid = lo + (hi - lo) / 2;
+
+    for (line = mid; line > lo && line[-1] != '\n'; line--);
+
+    line_end = memchr (line, '\n', hi - line);
+    if (line_end == NULL)
+      line_end = hi;
+
+    equal = memchr (line, '=', line_end - line);
+    if (equal == NULL)
+      equal = line_end;
+
+    cmp = compare_key (key, line, equal - line);
+
+    if (cmp == 0) {
+      if (equal == line_end)
+        return FALSE;
+
+      if (value)
+        *value = equal + 1;
+      if (length)
+        *length = line_end - (equal + 1);
+      return TRUE;
+    }
+
+    if (cmp < 0)
+      hi = line;
+    else
+      lo = line_end + 1;
+  }
+
+  return FALSE;
+}
+
+/* FNV-1a, also used by update-desktop-database for its stamps */
+guint64
+dfu_mime_cache_checksum_update (guint64     checksum,
+                                const void *data,
+                                gsize       length)
+{
+  const guchar *p = data;
+  gsize         i;
+
+  for (i = 0; i < length; i++)
+    checksum = (checksum ^ p[i]) * G_GINT64_CONSTANT (1099511628211U);
+
+  return checksum;
+}
+
+/* Caches without a header, or with a header of another version, are not
+ * checked */
+static gboolean
+verify_checksum (const char *data,
+                 gsize       length)
+{
+  char    header[MIME_CACHE_HEADER_LENGTH + 1];
+  guint   version;
+  guint   n_entries;
+  guint64 checksum;
+
+  if (length < MIME_CACHE_HEADER_LENGTH)
+    return TRUE;
+
+  memcpy (header, data, MIME_CACHE_HEADER_LENGTH);
+  header[MIME_CACHE_HEADER_LENGTH] = '\0';
+
+  if (sscanf (header, MIME_CACHE_HEADER_FORMAT,
+              &version, &n_entries, &checksum) != 3 ||
+      version != MIME_CACHE_HEADER_VERSION)
+    return TRUE;
+
+  return checksum ==
+         dfu_mime_cache_checksum_update (MIME_CACHE_CHECKSUM_INIT,
+                                         data + MIME_CACHE_HEADER_LENGTH,
+                                         length - MIME_CACHE_HEADER_LENGTH);
+}
+
+DfuMimeCache *
+dfu_mime_cache_new (const char  *filename,
+                    GError     **error)
+{
+  DfuMimeCache *cache;
+  struct stat   stat_buf;
+  int           fd;
+
+  g_return_val_if_fail (filename != NULL, NULL);
+
+  fd = open (filename, O_RDONLY);
+  if (fd < 0) {
+    g_set_error (error, G_FILE_ERROR,
+                 g_file_error_from_errno (errno),
+                 "%s", g_strerror (errno));
+    return NULL;
+  }
+
+  if (fstat (fd, &stat_buf) < 0) {
+    g_set_error (error, G_FILE_ERROR,
+                 g_file_error_from_errno (errno),
+                 "%s", g_strerror (errno));
+    close (fd);
+    return NULL;
+  }
+
+  cache = g_new0 (DfuMimeCache, 1);
+
+  if (stat_buf.st_size > 0) {
+    cache->data = mmap (NULL, stat_buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (cache->data == MAP_FAILED) {
+      g_set_error (error, G_FILE_ERROR,
+                   g_file_error_from_errno (errno),
+                   "%s", g_strerror (errno));
+      close (fd);
+      g_free (cache);
+      return NULL;
+    }
+
+    cache->length = stat_buf.st_size;
+  }
+
+  close (fd);
+
+  if (!find_group (cache->data, cache->length,
+                   MIME_CACHE_GROUP, &cache->mime_types))
+    cache->mime_types.start = cache->mime_types.end = NULL;
+
+  if (!find_group (cache->data, cache->length,
+                   MIME_CACHE_REVERSE_GROUP, &cache->desktop_ids))
+    cache->desktop_ids.start = cache->desktop_ids.end = NULL;
+
+  return cache;
+}
+
+/* Reads the whole cache to check that it was not damaged after it was
+ * written; dfu_mime_cache_new() does not do it, so that a lookup does not
+ * depend on the size of the cache. */
+gboolean
+dfu_mime_cache_verify (DfuMimeCache  *cache,
+                       GError       **error)
+{
+  g_return_val_if_fail (cache != NULL, FALSE);
+
+  if (!verify_checksum (cache->data, cache->length)) {
+    g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                 "The cache file does not match its checksum");
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+void
+dfu_mime_cache_free (DfuMimeCache *cache)
+{
+  if (cache == NULL)
+    return;
+
+  if (cache->data != NULL)
+    munmap (cache->data, cache->length);
+
+  g_free (cache);
+}
+
+/* On success, value points to the raw list of desktop IDs handling mime_type
+ * (eg, "gedit.desktop;gvim.desktop;"); it is not nul-terminated and is valid
+ * until the cache is freed. */
+gboolean
+dfu_mime_cache_lookup (DfuMimeCache  *cache,
+                       const char    *mime_type,
+                       const char   **value,
+                       gsize         *length)
+{
+  g_return_val_if_fail (cache != NULL, FALSE);
+  g_return_val_if_fail (mime_type != NULL, FALSE);
+
+  return lookup_in_group (&cache->mime_types, mime_type, value, length);
+}
+
+/* Same as dfu_mime_cache_lookup(), but returns the list of MIME types handled
+ * by desktop_id (eg, "text/plain;text/x-c;"). This needs a cache written by
+ * "update-desktop-database --reverse-index". */
+gboolean
+dfu_mime_cache_lookup_desktop_id (DfuMimeCache  *cache,
+                                  const char    *desktop_id,
+                                  const char   **value,
+                                  gsize         *length)
+{
+  g_return_val_if_fail (cache != NULL, FALSE);
+  g_return_val_if_fail (desktop_id != NULL, FALSE);
+
+  return lookup_in_group (&cache->desktop_ids, desktop_id, value, length);
+}
+
+/* Iterates over a list returned by dfu_mime_cache_lookup() or
+ * dfu_mime_cache_lookup_desktop_id(): each call returns the next item and
+ * advances value/length past it. */
+gboolean
+dfu_mime_cache_next_item (const char **value,
+                          gsize       *length,
+                          const char **item,
+                          gsize       *item_length)
+{
+  const char *semicolon;
+
+  g_return_val_if_fail (value != NULL && length != NULL, FALSE);
+
+  while (*length > 0) {
+    semicolon = memchr (*value, ';', *length);
+    if (semicolon == NULL)
+      semicolon = *value + *length;
+
+    *item = *value;
+    *item_length = semicolon - *value;
+
+    *length -= MIN (*length, *item_length + 1);
+    *value = semicolon + 1;
+
+    if (*item_length > 0)
+      return TRUE;
+  }
+
+  return FALSE;
+}
@@ -0,0 +1,68 @@
+/* mimecache.h: read-only access to mimeinfo.cache files
+ * vim: set ts=2 sw=2 et: */
+
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#ifndef MIMECACHE_H
+#define MIMECACHE_H
+
+#include <glib.h>
+
+#define MIME_CACHE_FILENAME      "mimeinfo.cache"
+#define MIME_CACHE_GROUP         "MIME Cache"
+#define MIME_CACHE_REVERSE_GROUP "Desktop ID Cache"
+
+/* The first line of a cache written by update-desktop-database gives the
+ * version of the format, the number of MIME types, and the checksum of
+ * everything after this line. It has a fixed length. */
+#define MIME_CACHE_HEADER_VERSION 1
+#define MIME_CACHE_HEADER_FORMAT "# mimeinfo.cache version %u entries %010u " \
+                                 "checksum %016" G_GINT64_MODIFIER "x\n"
+#define MIME_CACHE_HEADER_LENGTH (sizeof ("# mimeinfo.cache version 1 " \
+                                          "entries 0000000000 checksum " \
+                                          "0000000000000000\n") - 1)
+#define MIME_CACHE_CHECKSUM_INIT G_GINT64_CONSTANT (0xcbf29ce484222325U)
+
+typedef struct _DfuMimeCache DfuMimeCache;
+
+DfuMimeCache *dfu_mime_cache_new      (const char    *filename,
+                                       GError       **error);
+void          dfu_mime_cache_free     (DfuMimeCache  *cache);
+gboolean      dfu_mime_cache_verify   (DfuMimeCache  *cache,
+                                       GError       **error);
+
+gboolean      dfu_mime_cache_lookup   (DfuMimeCache  *cache,
+                                       const char    *mime_type,
+                                       const char   **value,
+                                       gsize         *length);
+
+gboolean      dfu_mime_cache_lookup_desktop_id (DfuMimeCache  *cache,
+                                                const char    *desktop_id,
+                                                const char   **value,
+                                                gsize         *length);
+
+guint64       dfu_mime_cache_checksum_update (guint64     checksum,
+                                              const void *data,
+                                              gsize       length);
+
+gboolean      dfu_mime_cache_next_item (const char  **value,
+                                        gsize        *length,
+                                        const char  **item,
+                                        gsize        *item_length);
+
+#endif /* MIMECACHE_H */
@@ -0,0 +1,302 @@
+/* query.c - looks up the mimetype<->desktop mapping cache
+ * vim: set ts=2 sw=2 et: */
+
+/*
+ * desktop-file-query is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * desktop-file-query is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with desktop-file-query; see the file COPYING.  If not,
+ * write to the Free Software Foundation, Inc., 51 Franklin Street,
+ * Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gi18n.h>
+
+#include "mimecache.h"
+
+static char *mime_type = NULL;
+static char *desktop_id = NULL;
+static char **desktop_dirs = NULL;
+static gboolean verify = FALSE;
+
+static const GOptionEntry options[] =
+ {
+   { "mime", 0, 0, G_OPTION_ARG_STRING, &mime_type,
+     N_("Look up the desktop files handling the MIME type TYPE"),
+     N_("TYPE") },
+
+   { "desktop-id", 0, 0, G_OPTION_ARG_STRING, &desktop_id,
+     N_("Look up the MIME types handled by the desktop file ID (needs a "
+        "database built with --reverse-index)"),
+     N_("ID") },
+
+   { "verify", 0, 0, G_OPTION_ARG_NONE, &verify,
+     N_("Check that each cache file was not damaged, and skip it if it was "
+        "(reads the whole cache files)"),
+     NULL },
+
+   { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &desktop_dirs,
+     NULL, N_("[DIRECTORY...]") },
+   { NULL }
+ };
+
+static char **
+get_default_search_path (void)
+{
+  const char * const *data_dirs;
+  char **args;
+  int i;
+
+  data_dirs = g_get_system_data_dirs ();
+
+  for (i = 0; data_dirs[i] != NULL; i++);
+
+  args = g_new (char *, i + 2);
+
+  args[0] = g_build_filename (g_get_user_data_dir (), "applications", NULL);
+  for (i = 0; data_dirs[i] != NULL; i++)
+    args[i + 1] = g_build_filename (data_dirs[i], "applications", NULL);
+
+  args[i + 1] = NULL;
+
+  return args;
+}
+
+static DfuMimeCache *
+open_directory_cache (const char *dir)
+{
+  DfuMimeCache *cache;
+  char         *cache_file;
+  GError       *error;
+
+  cache_file = g_build_filename (dir, MIME_CACHE_FILENAME, NULL);
+  error = NULL;
+  cache = dfu_mime_cache_new (cache_file, &error);
+
+  if (cache != NULL && verify && !dfu_mime_cache_verify (cache, &error))
+    {
+      dfu_mime_cache_free (cache);
+      cache = NULL;
+    }
+
+  /* directories without a cache are silently skipped */
+  if (error != NULL)
+    {
+      if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        g_printerr (_("Could not read cache file \"%s\": %s\n"),
+                    cache_file, error->message);
+      g_error_free (error);
+    }
+
+  g_free (cache_file);
+
+  return cache;
+}
+
+/* Whether dir has a desktop file with this ID. The ID of foo/bar.desktop is
+ * foo-bar.desktop, so each dash of the ID may be a directory separator. */
+static gboolean
+desktop_id_exists (const char *dir,
+                   const char *id)
+{
+  const char *dash;
+  char       *path;
+  gboolean    exists;
+
+  path = g_build_filename (dir, id, NULL);
+  exists = g_file_test (path, G_FILE_TEST_IS_REGULAR);
+  g_free (path);
+
+  for (dash = strchr (id, '-'); dash != NULL && !exists;
+       dash = strchr (dash + 1, '-'))
+    {
+      char *subdir_name;
+      char *subdir;
+
+      subdir_name = g_strndup (id, dash - id);
+      subdir = g_build_filename (dir, subdir_name, NULL);
+
+      if (g_file_test (subdir, G_FILE_TEST_IS_DIR))
+        exists = desktop_id_exists (subdir, dash + 1);
+
+      g_free (subdir);
+      g_free (subdir_name);
+    }
+
+  return exists;
+}
+
+/* Prints the items of value; with seen, the items already printed, and the
+ * desktop IDs of the n_hiding_dirs directories of hiding_dirs, are
+ * skipped */
+static void
+print_items (const char  *value,
+             gsize        length,
+             GHashTable  *seen,
+             char       **hiding_dirs,
+             int          n_hiding_dirs)
+{
+  const char *item;
+  gsize       item_length;
+  int         i;
+
+  while (dfu_mime_cache_next_item (&value, &length, &item, &item_length))
+    {
+      char *str;
+
+      str = g_strndup (item, item_length);
+
+      if (seen && g_hash_table_lookup (seen, str))
+        {
+          g_free (str);
+          continue;
+        }
+
+      for (i = 0; i < n_hiding_dirs; i++)
+        {
+          if (desktop_id_exists (hiding_dirs[i], str))
+            break;
+        }
+
+      if (i < n_hiding_dirs)
+        {
+          /* this desktop file, or another one with the same ID, does not
+           * handle the MIME type */
+          g_hash_table_insert (seen, str, str);
+          continue;
+        }
+
+      g_print ("%s\n", str);
+
+      if (seen)
+        g_hash_table_insert (seen, str, str);
+      else
+        g_free (str);
+    }
+}
+
+/* Prints the desktop IDs handling mime_type in desktop_dirs[index]. A
+ * desktop ID of an earlier directory hides the desktop files with this ID
+ * in this directory, even if it does not handle mime_type: such IDs, and
+ * IDs already printed, are skipped. */
+static gboolean
+query_mime_type (int         index,
+                 GHashTable *seen)
+{
+  DfuMimeCache *cache;
+  const char   *value;
+  gsize         length;
+  gboolean      found;
+
+  cache = open_directory_cache (desktop_dirs[index]);
+  if (cache == NULL)
+    return FALSE;
+
+  found = dfu_mime_cache_lookup (cache, mime_type, &value, &length);
+  if (found)
+    print_items (value, length, seen, desktop_dirs, index);
+
+  dfu_mime_cache_free (cache);
+
+  return found;
+}
+
+/* Prints the MIME types handled by desktop_id in dir. */
+static gboolean
+query_desktop_id (const char *dir)
+{
+  DfuMimeCache *cache;
+  const char   *value;
+  gsize         length;
+  gboolean      found;
+
+  cache = open_directory_cache (dir);
+  if (cache == NULL)
+    return FALSE;
+
+  found = dfu_mime_cache_lookup_desktop_id (cache, desktop_id,
+                                            &value, &length);
+  if (found)
+    print_items (value, length, NULL, NULL, 0);
+
+  dfu_mime_cache_free (cache);
+
+  return found;
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  GError *error;
+  GOptionContext *context;
+  GHashTable *seen;
+  gboolean found;
+  int i;
+
+  context = g_option_context_new ("");
+  g_option_context_set_summary (context, _("Query cache database of MIME types handled by desktop files."));
+  g_option_context_add_main_entries (context, options, NULL);
+
+  error = NULL;
+  g_option_context_parse (context, &argc, &argv, &error);
+
+  if (error != NULL) {
+    g_printerr ("%s\n", error->message);
+    g_printerr (_("Run \"%s --help\" to see a full list of available command line options.\n"), argv[0]);
+    g_error_free (error);
+    return 1;
+  }
+
+  g_option_context_free (context);
+
+  if ((mime_type == NULL) == (desktop_id == NULL))
+    {
+      g_printerr (_("Must specify either a MIME type or a desktop file ID to look up.\n"));
+      return 1;
+    }
+
+  if (desktop_dirs == NULL || desktop_dirs[0] == NULL)
+    desktop_dirs = get_default_search_path ();
+
+  found = FALSE;
+
+  if (desktop_id != NULL)
+    {
+      /* the first directory with this desktop ID hides the other ones,
+       * even if this desktop file handles no MIME type */
+      for (i = 0; desktop_dirs[i] != NULL; i++)
+        {
+          found = query_desktop_id (desktop_dirs[i]);
+          if (found || desktop_id_exists (desktop_dirs[i], desktop_id))
+            break;
+        }
+
+      return found ? 0 : 1;
+    }
+
+  seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  for (i = 0; desktop_dirs[i] != NULL; i++)
+    {
+      if (query_mime_type (i, seen))
+        found = TRUE;
+    }
+
+  g_hash_table_destroy (seen);
+
+  return found ? 0 : 1;
+}
@@ -25,53 +25,730 @@
  */
 
 #include <config.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <sched.h>
+#include <stdarg.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef HAVE_LINUX_IOPRIO_H
+#include <linux/ioprio.h>
+#include <sys/syscall.h>
+#endif
+
 #include <glib.h>
 #include <glib/gi18n.h>
 
+#include "filereader.h"
 #include "keyfileutils.h"
+#include "mimecache.h"
 #include "mimeutils.h"
 
 #define NAME "update-desktop-database"
-#define CACHE_FILENAME "mimeinfo.cache"
-#define TEMP_CACHE_FILENAME_PREFIX ".mimeinfo.cache.XXXXXX"
+#define TEMP_CACHE_FILENAME_PREFIX ".mimeinfo.cache."
+
+/* Rough cost of a hash table entry, used to estimate the memory used by the
+ * maps with --max-memory */
+#define HASH_ENTRY_SIZE (4 * sizeof (gpointer))
+/* Maximum number of temporary files merged at once with --max-memory */
+#define MAX_MERGED_RUNS 32
+/* Maximum number of threads reading files with --background */
+#define BACKGROUND_MAX_WORKERS 2
+/* With --background, progress is reported every PROGRESS_INTERVAL files */
+#define PROGRESS_INTERVAL 1024
+/* Maximum number of messages about desktop files printed for a directory,
+ * and of distinct MIME type problems summarized for a directory */
+#define MAX_DIAGNOSTICS 200
 
 #define udd_print(...) if (!quiet) g_printerr (__VA_ARGS__)
 #define udd_verbose_print(...) if (!quiet && verbose) g_printerr (__VA_ARGS__)
 
-static FILE *open_temp_cache_file (const char  *dir,
+typedef struct _DesktopFileList DesktopFileList;
+
+static FILE *open_temp_cache_file (int          dir_fd,
                                    char       **filename,
                                    GError     **error);
-static void add_mime_type (const char *mime_type, GList *desktop_files, FILE *f);
+static void add_mime_type (const char      *mime_type,
+                           DesktopFileList *desktop_files,
+                           FILE            *f);
+static void spill_maps (GError **error);
 static void sync_database (const char *dir, GError **error);
 static void cache_desktop_file (const char  *desktop_file,
                                 const char  *mime_type,
                                 GError     **error);
 static void process_desktop_file (const char  *desktop_file,
                                   const char  *name,
+                                  const char  *contents,
+                                  gsize        length,
                                   GError     **error);
 static void process_desktop_files (const char *desktop_dir,
+                                   const char *relative_dir,
                                    const char *prefix,
+                                   int depth,
                                    GError **error);
 static void update_database (const char *desktop_dir, GError **error);
 static const char ** get_default_search_path (void);
 static void print_desktop_dirs (const char **dirs);
 
+/* The lists of desktop files handling a mime type are hash-consed: a list is
+ * never modified once built, and prepending a desktop file to a list returns
+ * the one list made of this desktop file followed by that tail. Mime types
+ * handled by the same desktop files (all the image types of an image viewer,
+ * all the formats of an office suite) therefore point to the same list, and
+ * lists only differing by their head share their tail. */
+struct _DesktopFileList {
+  const char      *desktop_file;  /* interned in desktop_file_ids */
+  DesktopFileList *next;
+  char            *value;         /* serialized list, built when writing */
+};
+
 static GHashTable *mime_types_map = NULL;
-static gboolean verbose = FALSE, quiet = FALSE;
+static GHashTable *desktop_file_lists = NULL;
+static GStringChunk *desktop_file_ids = NULL;
+static GHashTable *visited_dirs = NULL;
+static gboolean verbose = FALSE, quiet = FALSE, reverse_index = FALSE;
+static int max_depth = -1;
+
+/* With --max-memory, the maps are written to temporary files (runs) each
+ * time they grow bigger than max_memory, and the runs are merged when the
+ * cache is written. A run has the same format as the body of a group of the
+ * cache: lines sorted by key, with sorted values. */
+static gsize max_memory = 0;
+static gsize memory_used = 0;
+static int cache_dir_fd = -1;
+static GPtrArray *mime_type_runs = NULL;
+static GPtrArray *desktop_id_runs = NULL;
+static GError *spill_error = NULL;
+
+/* Desktop files are read in batches, so that the I/O for all the files of a
+ * batch overlaps (see filereader.c); they are parsed once the whole batch
+ * has been read. */
+typedef struct {
+  DfuFileRead  reads[DFU_FILE_READER_MAX_BATCH];
+  char        *names[DFU_FILE_READER_MAX_BATCH];
+  guint        n_files;
+} DesktopFileBatch;
+
+/* A root directory given with --root */
+typedef struct {
+  char  *path;            /* NULL when not using --root */
+  guint  n_updated_dirs;
+} Root;
+
+/* With --sync=file, each cache file is flushed to disk before being renamed.
+ * With --sync=batch, the cache files of all the directories are written
+ * first, then flushed with one syncfs() per file system, and only then
+ * renamed: a crash leaves either the old or the new cache, never an empty
+ * one, without paying for one fsync() per cache file. */
+typedef enum {
+  SYNC_NONE,
+  SYNC_FILE,
+  SYNC_BATCH
+} SyncPolicy;
+
+typedef struct {
+  int    dir_fd;
+  char  *temp_file;   /* relative to dir_fd */
+  char  *temp_stamp_file;  /* relative to dir_fd, or NULL */
+  char  *cache_file;  /* for messages */
+  dev_t  dev;
+  Root  *root;
+} PendingCacheFile;
+
+static SyncPolicy sync_policy = SYNC_NONE;
+static GPtrArray *pending_cache_files = NULL;
+
+/* With --root, the directories are looked up inside each root in turn, as if
+ * it was the root directory. Desktop files are often identical in all the
+ * roots (images built from the same packages), so they are parsed only once:
+ * the result of the parsing is kept with the contents it comes from. */
+typedef struct {
+  char    *contents;
+  gsize    length;
+  guint    hash;
+
+  char   **mime_types;  /* NULL if the desktop file is hidden */
+  GError  *error;
+} ParsedDesktopFile;
+
+static Root *current_root = NULL;
+static int root_fd = -1;
+static GHashTable *parse_cache = NULL;
+
+/* With --check and --if-stale, whether a cache is up to date is decided
+ * without reading any desktop file. Package managers add and remove desktop
+ * files by renaming them, which changes the modification time of their
+ * directory: a stamp of the modification times of the subdirectories that
+ * were scanned (listed on the next lines), and the modification time of the
+ * directory of the cache itself, written once the cache has been renamed
+ * into it, are kept in a file next to the cache. They depend on the host
+ * and on when the cache was written, so they are kept out of the cache,
+ * whose contents only depend on the desktop files. The stamp file also
+ * counts how many times the cache has been written. */
+#define MIME_CACHE_STAMP_FILENAME MIME_CACHE_FILENAME ".stamp"
+#define STAMP_HEADER "# update-desktop-database stamp "
+#define STAMP_FORMAT STAMP_HEADER "%016" G_GINT64_MODIFIER "x " \
+                     "%020" G_GINT64_MODIFIER "u " \
+                     "generation %020" G_GINT64_MODIFIER "u " \
+                     "checksum %016" G_GINT64_MODIFIER "x " \
+                     "size %020" G_GINT64_MODIFIER "u\n"
+#define STAMP_DIRECTORY "# directory "
+#define STAMP_VALUE_LENGTH 16
+#define STAMP_VALUE_OFFSET (sizeof (STAMP_HEADER) - 1)
+#define STAMP_MTIME_LENGTH 20
+#define STAMP_MTIME_OFFSET (STAMP_VALUE_OFFSET + STAMP_VALUE_LENGTH + 1)
+
+typedef struct {
+  guint64  stamp;
+  guint64  mtime;       /* of the directory of the cache, in nanoseconds */
+  guint64  generation;
+  guint64  checksum;    /* of the cache, as in its header */
+  guint64  size;        /* of the cache */
+} StampHeader;
+
+/* The header of the cache, see mimecache.h */
+typedef struct {
+  guint    version;
+  guint    n_entries;
+  guint64  checksum;
+} CacheHeader;
+
+typedef struct {
+  char    *path;   /* relative to the directory of the cache */
+  guint64  mtime;  /* in nanoseconds */
+  guint64  ino;
+  dev_t    dev;    /* not in the stamp */
+} ScannedDirectory;
+
+/* A stamp written by this run, kept until the end of the run, see
+ * update_nested_stamps() */
+typedef struct {
+  int        dir_fd;
+  Root      *root;
+  dev_t      dev;
+  ino_t      ino;
+  guint64    generation;
+  guint64    checksum;
+  GPtrArray *scanned_dirs;
+} WrittenStamp;
+
+typedef enum {
+  CACHE_UP_TO_DATE,
+  CACHE_OUT_OF_DATE,
+  CACHE_NO_DIRECTORY
+} CacheState;
+
+static GPtrArray *scanned_dirs = NULL;
+static GPtrArray *written_stamps = NULL;
+static gboolean check = FALSE, if_stale = FALSE;
+static guint n_out_of_date_caches = 0;
+
+static DfuFileReaderBackend io_backend = DFU_FILE_READER_SYNC;
+static gboolean drop_cache = FALSE;
+static gboolean background = FALSE;
+static guint n_processed_files = 0;
+static DfuFileReader *file_reader = NULL;
+static DesktopFileBatch batch;
+
+/* With --stats, the time spent in each phase of the update of a directory is
+ * measured: the current phase is switched with stats_switch(), and the time
+ * elapsed since the last switch is added to the phase being left. */
+typedef enum {
+  PHASE_NONE,
+  PHASE_ENUMERATE,  /* walking the directories */
+  PHASE_READ,       /* reading desktop files */
+  PHASE_PARSE,      /* parsing desktop files */
+  PHASE_VALIDATE,   /* checking MIME types and adding them to the maps */
+  PHASE_SPILL,      /* writing temporary files, with --max-memory */
+  PHASE_WRITE,      /* writing and renaming the cache file */
+  N_PHASES
+} Phase;
+
+static const char * const phase_names[N_PHASES] = {
+  NULL, "enumerate", "read", "parse", "validate", "spill", "write"
+};
+
+typedef enum {
+  STATS_NONE,
+  STATS_TEXT,
+  STATS_JSON
+} StatsFormat;
+
+typedef struct {
+  guint64 wall_ns[N_PHASES];
+  guint64 cpu_ns[N_PHASES];
+  guint   n_directories;
+  guint   n_files_scanned;
+  guint   n_files_parsed;
+  guint   n_shared_parses;
+  guint64 n_bytes_read;
+  guint   n_mime_types;
+  guint   n_pairs;
+  guint64 n_syscalls;
+} Stats;
+
+/* Diagnostics about desktop files are collected while a directory is
+ * processed, and printed at once when it is done. Problems with MIME types
+ * are summarized by MIME type and reason; the message about each desktop
+ * file is only printed with --verbose. */
+typedef struct {
+  char  *message;
+  char  *first_file;
+  guint  n_files;
+} MimeTypeDiagnostic;
+
+static GHashTable *mime_type_diagnostics = NULL;
+static GPtrArray *mime_type_diagnostic_list = NULL;
+static guint n_dropped_mime_type_diagnostics = 0;
+static GString *file_diagnostics = NULL;
+static guint n_file_diagnostics = 0;
+
+static StatsFormat stats_format = STATS_NONE;
+static Stats stats;
+static Phase stats_phase = PHASE_NONE;
+static guint64 stats_wall_start, stats_cpu_start;
+/* directory being updated, and when its update started, for the progress
+ * reported with --background */
+static const char *stats_desktop_dir = NULL;
+static guint64 stats_update_start;
+
+/* Directories are identified by device and inode, so that a directory
+ * reached through several paths (symlinked vendor trees, bind mounts) is
+ * only scanned once, and a symlink loop is detected. */
+typedef enum {
+  DIRECTORY_IN_PROGRESS,
+  DIRECTORY_DONE
+} DirectoryState;
+
+typedef struct {
+  dev_t          dev;
+  ino_t          ino;
+  DirectoryState state;
+} DirectoryId;
+
+static guint64
+get_clock_ns (clockid_t clock)
+{
+  struct timespec ts;
+
+  if (clock_gettime (clock, &ts) < 0)
+    return 0;
+
+  return (guint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Makes phase the current phase, and returns the previous one. */
+static Phase
+stats_switch (Phase phase)
+{
+  Phase previous;
+  guint64 wall, cpu;
+
+  if (stats_format == STATS_NONE)
+    return PHASE_NONE;
+
+  previous = stats_phase;
+  if (phase == previous)
+    return previous;
+
+  wall = get_clock_ns (CLOCK_MONOTONIC);
+  cpu = get_clock_ns (CLOCK_PROCESS_CPUTIME_ID);
+
+  if (previous != PHASE_NONE)
+    {
+      stats.wall_ns[previous] += wall - stats_wall_start;
+      stats.cpu_ns[previous] += cpu - stats_cpu_start;
+    }
+
+  stats_phase = phase;
+  stats_wall_start = wall;
+  stats_cpu_start = cpu;
+
+  return previous;
+}
+
+static void
+print_json_string (const char *str)
+{
+  const char *p;
+
+  g_print ("\"");
+  for (p = str; *p != '\0'; p++)
+    {
+      if (*p == '"' || *p == '\\')
+        g_print ("\\%c", *p);
+      else if ((guchar) *p < 0x20)
+        g_print ("\\u%04x", (guint) *p);
+      else
+        g_print ("%c", *p);
+    }
+  g_print ("\"");
+}
+
+static void
+print_stats (const char   *desktop_dir,
+             const GError *error)
+{
+  char *display_dir;
+  int i;
+
+  display_dir = g_filename_display_name (desktop_dir);
+
+  if (stats_format == STATS_JSON)
+    {
+      g_print ("{\"directory\": ");
+      print_json_string (display_dir);
+
+      for (i = PHASE_NONE + 1; i < N_PHASES; i++)
+        g_print (", \"%s_wall_us\": %" G_GUINT64_FORMAT
+                 ", \"%s_cpu_us\": %" G_GUINT64_FORMAT,
+                 phase_names[i], stats.wall_ns[i] / 1000,
+                 phase_names[i], stats.cpu_ns[i] / 1000);
+
+      g_print (", \"directories_scanned\": %u, \"files_scanned\": %u"
+               ", \"files_parsed\": %u, \"shared_parses\": %u"
+               ", \"bytes_read\": %" G_GUINT64_FORMAT
+               ", \"mime_types\": %u, \"pairs\": %u"
+               ", \"read_syscalls\": %" G_GUINT64_FORMAT,
+               stats.n_directories, stats.n_files_scanned,
+               stats.n_files_parsed, stats.n_shared_parses, stats.n_bytes_read,
+               stats.n_mime_types, stats.n_pairs, stats.n_syscalls);
+
+      g_print (", \"status\": \"%s\"", error == NULL ? "ok" : "error");
+      if (error != NULL)
+        {
+          g_print (", \"error\": ");
+          print_json_string (error->message);
+        }
+      g_print ("}\n");
+    }
+  else
+    {
+      g_print (_("Statistics for \"%s\":\n"), display_dir);
+
+      for (i = PHASE_NONE + 1; i < N_PHASES; i++)
+        g_print (_("  %-10s %9.3f s wall, %9.3f s CPU\n"), phase_names[i],
+                 stats.wall_ns[i] / 1e9, stats.cpu_ns[i] / 1e9);
+
+      g_print (_("  Directories scanned: %u\n"), stats.n_directories);
+      g_print (_("  Desktop files scanned: %u\n"), stats.n_files_scanned);
+      g_print (_("  Desktop files parsed: %u\n"), stats.n_files_parsed);
+      g_print (_("  Desktop files already parsed in another root: %u\n"),
+               stats.n_shared_parses);
+      g_print (_("  Bytes read: %" G_GUINT64_FORMAT "\n"), stats.n_bytes_read);
+      g_print (_("  MIME types: %u\n"), stats.n_mime_types);
+      g_print (_("  MIME type/desktop file pairs: %u\n"), stats.n_pairs);
+      g_print (_("  System calls to read files: %" G_GUINT64_FORMAT "\n"),
+               stats.n_syscalls);
+
+      if (error == NULL)
+        g_print (_("  Cache file written\n"));
+      else
+        g_print (_("  Cache file not written: %s\n"), error->message);
+    }
+
+  g_free (display_dir);
+}
+
+/* With --background, progress is printed with the statistics as the files
+ * of a directory are processed */
+static void
+print_progress (void)
+{
+  char *display_dir;
+  guint64 elapsed_ns;
+
+  display_dir = g_filename_display_name (stats_desktop_dir);
+  elapsed_ns = get_clock_ns (CLOCK_MONOTONIC) - stats_update_start;
+
+  if (stats_format == STATS_JSON)
+    {
+      g_print ("{\"progress\": {\"directory\": ");
+      print_json_string (display_dir);
+      g_print (", \"files_scanned\": %u"
+               ", \"bytes_read\": %" G_GUINT64_FORMAT
+               ", \"elapsed_us\": %" G_GUINT64_FORMAT "}}\n",
+               stats.n_files_scanned, stats.n_bytes_read, elapsed_ns / 1000);
+    }
+  else
+    g_print (_("Progress for \"%s\": %u desktop files scanned, %.3f s "
+               "elapsed\n"),
+             display_dir, stats.n_files_scanned, elapsed_ns / 1e9);
+
+  g_free (display_dir);
+}
+
+static void
+print_peak_rss (void)
+{
+  struct rusage usage;
+
+  if (getrusage (RUSAGE_SELF, &usage) < 0)
+    return;
+
+  /* ru_maxrss is in kilobytes on Linux */
+  if (stats_format == STATS_JSON)
+    g_print ("{\"peak_rss_kb\": %ld}\n", usage.ru_maxrss);
+  else
+    g_print (_("Peak resident set size: %ld KiB\n"), usage.ru_maxrss);
+}
+
+static void
+mime_type_diagnostic_free (MimeTypeDiagnostic *diagnostic)
+{
+  g_free (diagnostic->message);
+  g_free (diagnostic->first_file);
+  g_free (diagnostic);
+}
+
+static void
+init_diagnostics (void)
+{
+  mime_type_diagnostics = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                 NULL,
+                                                 (GDestroyNotify) mime_type_diagnostic_free);
+  mime_type_diagnostic_list = g_ptr_array_new ();
+  n_dropped_mime_type_diagnostics = 0;
+  file_diagnostics = g_string_new (NULL);
+  n_file_diagnostics = 0;
+}
+
+static void
+add_file_diagnostic (const char *format, ...)
+{
+  va_list args;
+  gchar *str;
+
+  if (quiet)
+    return;
+
+  n_file_diagnostics++;
+  if (n_file_diagnostics > MAX_DIAGNOSTICS)
+    return;
+
+  va_start (args, format);
+  str = g_strdup_vprintf (format, args);
+  va_end (args);
+
+  g_string_append (file_diagnostics, str);
+
+  g_free (str);
+}
+
+/* message describes the problem without naming the desktop file, so that
+ * all the desktop files having the same problem share it. */
+static void
+add_mime_type_diagnostic (const char *desktop_file,
+                          char       *message)
+{
+  MimeTypeDiagnostic *diagnostic;
+
+  if (quiet)
+    {
+      g_free (message);
+      return;
+    }
+
+  if (verbose)
+    add_file_diagnostic (_("In file \"%s\": %s\n"), desktop_file, message);
+
+  diagnostic = g_hash_table_lookup (mime_type_diagnostics, message);
+  if (diagnostic != NULL)
+    {
+      diagnostic->n_files++;
+      g_free (message);
+      return;
+    }
+
+  if (mime_type_diagnostic_list->len >= MAX_DIAGNOSTICS)
+    {
+      n_dropped_mime_type_diagnostics++;
+      g_free (message);
+      return;
+    }
+
+  diagnostic = g_new (MimeTypeDiagnostic, 1);
+  diagnostic->message = message;
+  diagnostic->first_file = g_strdup (desktop_file);
+  diagnostic->n_files = 1;
+
+  g_hash_table_insert (mime_type_diagnostics, diagnostic->message, diagnostic);
+  g_ptr_array_add (mime_type_diagnostic_list, diagnostic);
+}
+
+/* Prints the diagnostics collected so far with one write, and frees them. */
+static void
+flush_diagnostics (void)
+{
+  GString *output;
+  guint i;
+
+  output = file_diagnostics;
+
+  if (n_file_diagnostics > MAX_DIAGNOSTICS)
+    g_string_append_printf (output,
+                            _("%u more messages about desktop files were "
+                              "not displayed\n"),
+                            n_file_diagnostics - MAX_DIAGNOSTICS);
+
+  for (i = 0; i < mime_type_diagnostic_list->len; i++)
+    {
+      MimeTypeDiagnostic *diagnostic;
+
+      diagnostic = g_ptr_array_index (mime_type_diagnostic_list, i);
+
+      if (diagnostic->n_files == 1)
+        g_string_append_printf (output, _("%s (in file \"%s\")\n"),
+                                diagnostic->message, diagnostic->first_file);
+      else
+        g_string_append_printf (output,
+                                _("%s (in %u files, first one is \"%s\")\n"),
+                                diagnostic->message, diagnostic->n_files,
+                                diagnostic->first_file);
+    }
+
+  if (n_dropped_mime_type_diagnostics > 0)
+    g_string_append_printf (output,
+                            _("%u more problems with MIME types were not "
+                              "displayed\n"),
+                            n_dropped_mime_type_diagnostics);
+
+  if (output->len > 0)
+    {
+      fwrite (output->str, 1, output->len, stderr);
+      fflush (stderr);
+    }
+
+  g_string_free (output, TRUE);
+  g_ptr_array_free (mime_type_diagnostic_list, TRUE);
+  g_hash_table_destroy (mime_type_diagnostics);
+  file_diagnostics = NULL;
+  mime_type_diagnostic_list = NULL;
+  mime_type_diagnostics = NULL;
+}
+
+static guint
+directory_id_hash (gconstpointer key)
+{
+  const DirectoryId *id = key;
+
+  return (guint) id->ino ^ ((guint) id->dev << 16);
+}
+
+static gboolean
+directory_id_equal (gconstpointer a,
+                    gconstpointer b)
+{
+  const DirectoryId *id_a = a;
+  const DirectoryId *id_b = b;
+
+  return id_a->ino == id_b->ino && id_a->dev == id_b->dev;
+}
+
+static guint
+desktop_file_list_hash (gconstpointer key)
+{
+  const DesktopFileList *list = key;
+
+  return GPOINTER_TO_UINT (list->desktop_file) * 31 +
+         GPOINTER_TO_UINT (list->next);
+}
+
+static gboolean
+desktop_file_list_equal (gconstpointer a,
+                         gconstpointer b)
+{
+  const DesktopFileList *list_a = a;
+  const DesktopFileList *list_b = b;
+
+  /* desktop file IDs are interned, comparing pointers is enough */
+  return list_a->desktop_file == list_b->desktop_file &&
+         list_a->next == list_b->next;
+}
 
 static void
-list_free_deep (gpointer key, GList *l, gpointer data)
+desktop_file_list_free (DesktopFileList *list)
+{
+  g_free (list->value);
+  g_free (list);
+}
+
+static DesktopFileList *
+desktop_file_list_prepend (DesktopFileList *next,
+                           const char      *desktop_file)
+{
+  DesktopFileList key, *list;
+
+  key.desktop_file = desktop_file;
+  key.next = next;
+
+  list = g_hash_table_lookup (desktop_file_lists, &key);
+  if (list != NULL)
+    return list;
+
+  list = g_new0 (DesktopFileList, 1);
+  list->desktop_file = desktop_file;
+  list->next = next;
+  g_hash_table_insert (desktop_file_lists, list, list);
+
+  memory_used += sizeof (DesktopFileList) + HASH_ENTRY_SIZE;
+
+  return list;
+}
+
+static int
+compare_desktop_file_ids (gconstpointer a,
+                          gconstpointer b)
+{
+  return strcmp (*(const char **) a, *(const char **) b);
+}
+
+/* Returns the "a.desktop;b.desktop;" value for list, built only once for all
+ * the mime types sharing it. The list itself is in the order the desktop
+ * files were read from the file system, which differs from host to host:
+ * the value is sorted by desktop file ID (with duplicates removed) so that
+ * the same desktop files always give the same cache. */
+static const char *
+desktop_file_list_get_value (DesktopFileList *list)
 {
-  g_list_foreach (l, (GFunc)g_free, NULL);
-  g_list_free (l);
+  GPtrArray *desktop_files;
+  GString *value;
+  DesktopFileList *l;
+  guint i;
+
+  if (list->value != NULL)
+    return list->value;
+
+  desktop_files = g_ptr_array_new ();
+  for (l = list; l != NULL; l = l->next)
+    g_ptr_array_add (desktop_files, (gpointer) l->desktop_file);
+
+  g_ptr_array_sort (desktop_files, compare_desktop_file_ids);
+
+  value = g_string_new (NULL);
+  for (i = 0; i < desktop_files->len; i++)
+    {
+      /* desktop file IDs are interned, so duplicates are the same pointer */
+      if (i > 0 &&
+          g_ptr_array_index (desktop_files, i) ==
+          g_ptr_array_index (desktop_files, i - 1))
+        continue;
+
+      g_string_append (value, g_ptr_array_index (desktop_files, i));
+      g_string_append_c (value, ';');
+    }
+
+  g_ptr_array_free (desktop_files, TRUE);
+  list->value = g_string_free (value, FALSE);
+
+  return list->value;
 }
 
 static void
@@ -79,85 +756,190 @@ cache_desktop_file (const char  *desktop_file,
                     const char  *mime_type,
                     GError     **error)
 {
-  GList *desktop_files;
+  DesktopFileList *desktop_files;
+  char *key;
 
-  desktop_files = (GList *) g_hash_table_lookup (mime_types_map, mime_type);
+  key = NULL;
+  if (!g_hash_table_lookup_extended (mime_types_map, mime_type,
+                                     (gpointer *) &key,
+                                     (gpointer *) &desktop_files))
+    desktop_files = NULL;
 
   /* do not add twice a desktop file mentioning the mime type more than once
-   * (no need to use g_list_find() because we cache all mime types registered
-   * by a desktop file before moving to another desktop file) */
-  if (desktop_files &&
-      strcmp (desktop_file, (const char *) desktop_files->data) == 0)
+   * (no need to look further in the list because we cache all mime types
+   * registered by a desktop file before moving to another desktop file) */
+  if (desktop_files && desktop_files->desktop_file == desktop_file)
     return;
 
-  desktop_files = g_list_prepend (desktop_files, g_strdup (desktop_file));
-  g_hash_table_insert (mime_types_map, g_strdup (mime_type), desktop_files);
+  desktop_files = desktop_file_list_prepend (desktop_files, desktop_file);
+  stats.n_pairs++;
+  /* room for "desktop_file;" when the list is written */
+  memory_used += strlen (desktop_file) + 1;
+
+  if (key != NULL)
+    g_hash_table_steal (mime_types_map, key);
+  else
+    {
+      key = g_strdup (mime_type);
+      memory_used += strlen (key) + 1 + HASH_ENTRY_SIZE;
+    }
+
+  g_hash_table_insert (mime_types_map, key, desktop_files);
 }
 
 
 static void
-process_desktop_file (const char  *desktop_file,
-                      const char  *name,
-                      GError     **error)
+parsed_desktop_file_free (ParsedDesktopFile *parsed)
 {
-  GError *load_error;
+  g_free (parsed->contents);
+  g_strfreev (parsed->mime_types);
+  if (parsed->error != NULL)
+    g_error_free (parsed->error);
+  g_free (parsed);
+}
+
+static guint
+parsed_desktop_file_hash (gconstpointer key)
+{
+  const ParsedDesktopFile *parsed = key;
+
+  return parsed->hash;
+}
+
+static gboolean
+parsed_desktop_file_equal (gconstpointer a,
+                           gconstpointer b)
+{
+  const ParsedDesktopFile *parsed_a = a;
+  const ParsedDesktopFile *parsed_b = b;
+
+  return parsed_a->length == parsed_b->length &&
+         memcmp (parsed_a->contents, parsed_b->contents, parsed_a->length) == 0;
+}
+
+static ParsedDesktopFile *
+parse_desktop_file (const char *contents,
+                    gsize       length)
+{
+  ParsedDesktopFile *parsed;
   GKeyFile *keyfile;
-  char **mime_types;
   int i;
 
+  parsed = g_new0 (ParsedDesktopFile, 1);
   keyfile = g_key_file_new ();
 
-  load_error = NULL;
-  g_key_file_load_from_file (keyfile, desktop_file,
-                             G_KEY_FILE_NONE, &load_error);
+  g_key_file_load_from_data (keyfile, contents, length,
+                             G_KEY_FILE_NONE, &parsed->error);
 
-  if (load_error != NULL)
+  /* Hidden=true means that the .desktop file should be completely ignored */
+  if (parsed->error == NULL &&
+      !g_key_file_get_boolean (keyfile, GROUP_DESKTOP_ENTRY, "Hidden", NULL))
     {
-      g_propagate_error (error, load_error);
-      return;
+      parsed->mime_types = g_key_file_get_string_list (keyfile,
+                                                       GROUP_DESKTOP_ENTRY,
+                                                       "MimeType", NULL,
+                                                       &parsed->error);
+      for (i = 0; parsed->mime_types && parsed->mime_types[i] != NULL; i++)
+        g_strchomp (parsed->mime_types[i]);
     }
 
-  /* Hidden=true means that the .desktop file should be completely ignored */
-  if (g_key_file_get_boolean (keyfile, GROUP_DESKTOP_ENTRY, "Hidden", NULL))
+  g_key_file_free (keyfile);
+
+  return parsed;
+}
+
+/* Returns the parsed desktop file, from parse_cache if the same contents
+ * have already been parsed for another root. A cryptographic checksum would
+ * cost more than parsing: a cheap hash is used, and the contents compared. */
+static ParsedDesktopFile *
+lookup_parsed_desktop_file (const char *contents,
+                            gsize       length)
+{
+  ParsedDesktopFile key, *parsed;
+  gsize i;
+
+  if (parse_cache == NULL)
+    return parse_desktop_file (contents, length);
+
+  key.contents = (char *) contents;
+  key.length = length;
+  key.hash = 5381;
+  for (i = 0; i < length; i++)
+    key.hash = key.hash * 33 + (guchar) contents[i];
+
+  parsed = g_hash_table_lookup (parse_cache, &key);
+  if (parsed != NULL)
     {
-      g_key_file_free (keyfile);
-      return;
+      stats.n_shared_parses++;
+      return parsed;
     }
 
-  mime_types = g_key_file_get_string_list (keyfile,
-                                           GROUP_DESKTOP_ENTRY,
-                                           "MimeType", NULL, &load_error);
+  parsed = parse_desktop_file (contents, length);
+  parsed->contents = g_malloc (length);
+  memcpy (parsed->contents, contents, length);
+  parsed->length = length;
+  parsed->hash = key.hash;
+  g_hash_table_insert (parse_cache, parsed, parsed);
 
-  g_key_file_free (keyfile);
+  return parsed;
+}
+
+static void
+process_desktop_file (const char  *desktop_file,
+                      const char  *name,
+                      const char  *contents,
+                      gsize        length,
+                      GError     **error)
+{
+  GError *load_error;
+  ParsedDesktopFile *parsed;
+  char **mime_types;
+  const char *desktop_file_id;
+  int i;
+
+  stats_switch (PHASE_PARSE);
 
-  if (load_error != NULL)
+  parsed = lookup_parsed_desktop_file (contents, length);
+  mime_types = parsed->mime_types;
+
+  if (parsed->error != NULL)
     {
-      g_propagate_error (error, load_error);
-      return;
+      g_propagate_error (error, g_error_copy (parsed->error));
+      goto out;
     }
 
+  if (mime_types == NULL)
+    goto out;
+
+  stats.n_files_parsed++;
+  stats_switch (PHASE_VALIDATE);
+
+  desktop_file_id = g_string_chunk_insert_const (desktop_file_ids, name);
+  memory_used += strlen (name) + 1;
+
+  load_error = NULL;
   for (i = 0; mime_types[i] != NULL; i++)
     {
-      char *mime_type;
       MimeUtilsValidity valid;
       char *valid_error;
 
-      mime_type = g_strchomp (mime_types[i]);
       valid = mu_mime_type_is_valid (mime_types[i], &valid_error);
       switch (valid)
       {
         case MU_VALID:
           break;
         case MU_DISCOURAGED:
-          udd_print (_("Warning in file \"%s\": usage of MIME type \"%s\" is "
-                       "discouraged (%s)\n"),
-                     desktop_file, mime_types[i], valid_error);
+          add_mime_type_diagnostic (desktop_file,
+                                    g_strdup_printf (_("Warning: usage of MIME type \"%s\" is "
+                                                       "discouraged (%s)"),
+                                                     mime_types[i], valid_error));
           g_free (valid_error);
           break;
         case MU_INVALID:
-          udd_print (_("Error in file \"%s\": \"%s\" is an invalid MIME type "
-                       "(%s)\n"),
-                     desktop_file, mime_types[i], valid_error);
+          add_mime_type_diagnostic (desktop_file,
+                                    g_strdup_printf (_("Error: \"%s\" is an invalid MIME type "
+                                                       "(%s)"),
+                                                     mime_types[i], valid_error));
           g_free (valid_error);
           /* not a break: we continue to the next mime type */
           continue;
@@ -165,205 +947,1543 @@ process_desktop_file (const char  *desktop_file,
           g_assert_not_reached ();
       }
 
-      cache_desktop_file (name, mime_type, &load_error);
+      cache_desktop_file (desktop_file_id, mime_types[i], &load_error);
 
       if (load_error != NULL)
         {
           g_propagate_error (error, load_error);
-          g_strfreev (mime_types);
-          return;
+          goto out;
         }
     }
-  g_strfreev (mime_types);
+
+out:
+  if (parse_cache == NULL)
+    parsed_desktop_file_free (parsed);
 }
 
+/* Reads and parses the desktop files queued in batch. */
 static void
-process_desktop_files (const char  *desktop_dir,
-                       const char  *prefix,
-                       GError     **error)
+process_batch (void)
 {
-  GError *process_error;
-  GDir *dir;
-  const char *filename;
+  Phase previous_phase;
+  guint i;
 
-  process_error = NULL;
-  dir = g_dir_open (desktop_dir, 0, &process_error);
-
-  if (process_error != NULL)
-    {
-      g_propagate_error (error, process_error);
-      return;
-    }
+  previous_phase = stats_switch (PHASE_READ);
+  dfu_file_reader_read (file_reader, batch.reads, batch.n_files);
 
-  while ((filename = g_dir_read_name (dir)) != NULL)
+  for (i = 0; i < batch.n_files; i++)
     {
-      char *full_path, *name;
-
-      full_path = g_build_filename (desktop_dir, filename, NULL);
-
-      if (g_file_test (full_path, G_FILE_TEST_IS_DIR))
-        {
-          char *sub_prefix;
-
-          sub_prefix = g_strdup_printf ("%s%s-", prefix, filename);
-
-          process_desktop_files (full_path, sub_prefix, &process_error);
-          g_free (sub_prefix);
+      DfuFileRead *file = &batch.reads[i];
+      GError *process_error;
 
-          if (process_error != NULL)
-            {
-              udd_verbose_print (_("Could not process directory \"%s\": %s\n"),
-                                 full_path, process_error->message);
-              g_error_free (process_error);
-              process_error = NULL;
-            }
-          g_free (full_path);
-          continue;
-        }
-      else if (!g_str_has_suffix (filename, ".desktop"))
-        {
-          g_free (full_path);
-          continue;
-        }
+      if (file->error == NULL)
+        stats.n_bytes_read += file->length;
 
-      name = g_strdup_printf ("%s%s", prefix, filename);
-      process_desktop_file (full_path, name, &process_error);
-      g_free (name);
+      process_error = file->error;
+      if (process_error == NULL && spill_error == NULL)
+        process_desktop_file (file->path, batch.names[i],
+                              file->contents, file->length, &process_error);
 
       if (process_error != NULL)
         {
           if (!g_error_matches (process_error,
                                 G_KEY_FILE_ERROR,
                                 G_KEY_FILE_ERROR_KEY_NOT_FOUND))
-            {
-              udd_print (_("Could not parse file \"%s\": %s\n"), full_path,
-                         process_error->message);
-            }
-          else
-            {
-              udd_verbose_print (_("File \"%s\" lacks MimeType key\n"),
-                                 full_path);
-            }
+            add_file_diagnostic (_("Could not parse file \"%s\": %s\n"),
+                                 file->path, process_error->message);
+          else if (verbose)
+            add_file_diagnostic (_("File \"%s\" lacks MimeType key\n"),
+                                 file->path);
 
           g_error_free (process_error);
-          process_error = NULL;
         }
 
-      g_free (full_path);
+      g_free ((char *) file->path);
+      g_free (file->contents);
+      g_free (batch.names[i]);
+
+      if (max_memory > 0 && memory_used > max_memory && spill_error == NULL)
+        spill_maps (&spill_error);
     }
 
-  g_dir_close (dir);
+  stats_switch (previous_phase);
+
+  n_processed_files += batch.n_files;
+  stats.n_files_scanned += batch.n_files;
+  batch.n_files = 0;
+
+  if (background)
+    {
+      if (n_processed_files % PROGRESS_INTERVAL < DFU_FILE_READER_MAX_BATCH)
+        {
+          udd_verbose_print (_("Processed %u desktop files\n"),
+                             n_processed_files);
+          if (stats_format != STATS_NONE)
+            print_progress ();
+        }
+
+      /* let interactive processes run between two batches */
+      sched_yield ();
+    }
+}
+
+static void
+queue_desktop_file (char *desktop_file,
+                    char *name)
+{
+  batch.reads[batch.n_files].path = desktop_file;
+  batch.names[batch.n_files] = name;
+  batch.n_files++;
+
+  if (batch.n_files == DFU_FILE_READER_MAX_BATCH)
+    process_batch ();
+}
+
+/* Like stat(), inside the root if there is one. */
+static gboolean
+stat_path (const char  *path,
+           struct stat *buf)
+{
+  int fd;
+  gboolean ret;
+
+  if (root_fd < 0)
+    return stat (path, buf) == 0;
+
+  fd = dfu_open_in_root (root_fd, path, O_PATH);
+  if (fd < 0)
+    return FALSE;
+
+  ret = fstat (fd, buf) == 0;
+  close (fd);
+
+  return ret;
+}
+
+/* Returns whether path is a directory, following symbolic links. */
+static gboolean
+path_is_directory (const char *path)
+{
+  struct stat buf;
+
+  return stat_path (path, &buf) && S_ISDIR (buf.st_mode);
+}
+
+static guint64
+get_mtime_ns (const struct stat *buf)
+{
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+  return (guint64) buf->st_mtim.tv_sec * 1000000000 + buf->st_mtim.tv_nsec;
+#else
+  return (guint64) buf->st_mtime * 1000000000;
+#endif
+}
+
+static void
+scanned_directory_free (ScannedDirectory *dir)
+{
+  g_free (dir->path);
+  g_free (dir);
+}
+
+static void
+add_scanned_directory (GPtrArray         *dirs,
+                       const char        *path,
+                       const struct stat *buf)
+{
+  ScannedDirectory *dir;
+
+  dir = g_new (ScannedDirectory, 1);
+  dir->path = g_strdup (path);
+  dir->mtime = get_mtime_ns (buf);
+  dir->ino = buf->st_ino;
+  dir->dev = buf->st_dev;
+  g_ptr_array_add (dirs, dir);
+}
+
+static void
+free_scanned_directories (GPtrArray *dirs)
+{
+  g_ptr_array_foreach (dirs, (GFunc) scanned_directory_free, NULL);
+  g_ptr_array_free (dirs, TRUE);
+}
+
+static int
+compare_scanned_directories (gconstpointer a,
+                             gconstpointer b)
+{
+  const ScannedDirectory *dir_a = *(const ScannedDirectory **) a;
+  const ScannedDirectory *dir_b = *(const ScannedDirectory **) b;
+
+  return strcmp (dir_a->path, dir_b->path);
+}
+
+/* Returns the stamp of dirs, in this order, and of the options changing the
+ * contents of the cache. It is never 0, which stands for no stamp. */
+static guint64
+compute_stamp (GPtrArray *dirs)
+{
+  guint64 stamp;
+  char *options;
+  guint i;
+
+  options = g_strdup_printf ("reverse-index=%d max-depth=%d",
+                             reverse_index, max_depth);
+  stamp = dfu_mime_cache_checksum_update (MIME_CACHE_CHECKSUM_INIT,
+                                          options, strlen (options) + 1);
+  g_free (options);
+
+  for (i = 0; i < dirs->len; i++)
+    {
+      ScannedDirectory *dir = g_ptr_array_index (dirs, i);
+
+      stamp = dfu_mime_cache_checksum_update (stamp, dir->path,
+                                              strlen (dir->path) + 1);
+      stamp = dfu_mime_cache_checksum_update (stamp, &dir->mtime,
+                                              sizeof (dir->mtime));
+      stamp = dfu_mime_cache_checksum_update (stamp, &dir->ino,
+                                              sizeof (dir->ino));
+    }
+
+  return stamp != 0 ? stamp : 1;
+}
+
+static void
+write_cache_header (FILE              *f,
+                    const CacheHeader *header)
+{
+  fprintf (f, MIME_CACHE_HEADER_FORMAT, header->version, header->n_entries,
+           header->checksum);
+}
+
+static gboolean
+parse_cache_header (const char  *line,
+                    CacheHeader *header)
+{
+  if (sscanf (line, MIME_CACHE_HEADER_FORMAT, &header->version,
+              &header->n_entries, &header->checksum) != 3)
+    return FALSE;
+
+  return header->version == MIME_CACHE_HEADER_VERSION;
+}
+
+/* Computes the checksum of the contents of fd from offset to the end. */
+static gboolean
+compute_checksum (int       fd,
+                  off_t     offset,
+                  guint64  *checksum)
+{
+  char buffer[65536];
+  ssize_t n;
+
+  *checksum = MIME_CACHE_CHECKSUM_INIT;
+
+  while ((n = pread (fd, buffer, sizeof (buffer), offset)) != 0)
+    {
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return FALSE;
+        }
+
+      *checksum = dfu_mime_cache_checksum_update (*checksum, buffer, n);
+      offset += n;
+    }
+
+  return TRUE;
+}
+
+/* Reads the next line of f, without its newline, into line. */
+static gboolean
+read_stamp_line (FILE    *f,
+                 char    *line,
+                 gsize    size)
+{
+  gsize length;
+
+  if (fgets (line, size, f) == NULL)
+    return FALSE;
+
+  length = strlen (line);
+  if (length == 0 || line[length - 1] != '\n')
+    return FALSE;
+
+  line[length - 1] = '\0';
+
+  return TRUE;
+}
+
+static gboolean
+read_stamp_header (FILE        *f,
+                   StampHeader *header)
+{
+  char line[sizeof (STAMP_HEADER) + 128];
+
+  if (!read_stamp_line (f, line, sizeof (line)) ||
+      sscanf (line, STAMP_FORMAT, &header->stamp, &header->mtime,
+              &header->generation, &header->checksum, &header->size) != 5)
+    return FALSE;
+
+  return header->stamp != 0;
+}
+
+/* Opens the stamp file in dir_fd for reading. */
+static FILE *
+open_stamp_file (int dir_fd)
+{
+  FILE *f;
+  int fd;
+
+  fd = openat (dir_fd, MIME_CACHE_STAMP_FILENAME, O_RDONLY | O_NOFOLLOW);
+  if (fd < 0)
+    return NULL;
+
+  f = fdopen (fd, "r");
+  if (f == NULL)
+    close (fd);
+
+  return f;
+}
+
+/* Returns the generation of the cache in dir_fd, or 0 if it has none. */
+static guint64
+get_cache_generation (int dir_fd)
+{
+  StampHeader header;
+  FILE *f;
+  gboolean found;
+
+  f = open_stamp_file (dir_fd);
+  if (f == NULL)
+    return 0;
+
+  found = read_stamp_header (f, &header);
+  fclose (f);
+
+  return found ? header.generation : 0;
+}
+
+/* Writes the stamp of the scanned directories to f; the modification time
+ * of the directory of the cache is left to write_directory_mtime(), since
+ * writing the cache and its stamp changes it. */
+static void
+write_stamp (FILE              *f,
+             const StampHeader *header)
+{
+  guint i;
+
+  g_ptr_array_sort (scanned_dirs, compare_scanned_directories);
+
+  fprintf (f, STAMP_FORMAT, compute_stamp (scanned_dirs), (guint64) 0,
+           header->generation, header->checksum, header->size);
+
+  for (i = 0; i < scanned_dirs->len; i++)
+    {
+      ScannedDirectory *dir = g_ptr_array_index (scanned_dirs, i);
+      char *escaped_path;
+
+      /* a line feed in a path would end the comment */
+      escaped_path = g_strescape (dir->path, NULL);
+      fprintf (f, STAMP_DIRECTORY "%s\n", escaped_path);
+      g_free (escaped_path);
+    }
+}
+
+/* Writes the stamp of a cache to a temporary file in dir_fd, and returns its
+ * name, or NULL if it could not be written. */
+static char *
+write_stamp_file (int                dir_fd,
+                  const StampHeader *header)
+{
+  GError *stamp_error;
+  char *temp_stamp_file;
+  FILE *f;
+  gboolean failed;
+
+  temp_stamp_file = NULL;
+  stamp_error = NULL;
+  f = open_temp_cache_file (dir_fd, &temp_stamp_file, &stamp_error);
+  if (f == NULL)
+    {
+      udd_verbose_print (_("Could not write cache file stamp: %s\n"),
+                         stamp_error->message);
+      g_error_free (stamp_error);
+      return NULL;
+    }
+
+  write_stamp (f, header);
+  failed = ferror (f);
+  if (fclose (f) != 0 || failed)
+    {
+      udd_verbose_print (_("Could not write cache file stamp: %s\n"),
+                         g_strerror (errno));
+      unlinkat (dir_fd, temp_stamp_file, 0);
+      g_free (temp_stamp_file);
+      return NULL;
+    }
+
+  return temp_stamp_file;
+}
+
+/* Writes the modification time of dir_fd in the stamp of the cache it
+ * contains. The stamp is modified in place, which does not change the
+ * modification time of the directory. */
+static void
+write_directory_mtime (int dir_fd)
+{
+  struct stat buf;
+  char mtime[STAMP_MTIME_LENGTH + 1];
+  int fd;
+
+  if (fstat (dir_fd, &buf) < 0)
+    return;
+
+  fd = openat (dir_fd, MIME_CACHE_STAMP_FILENAME, O_WRONLY | O_NOFOLLOW);
+  if (fd < 0)
+    return;
+
+  g_snprintf (mtime, sizeof (mtime), "%0*" G_GINT64_MODIFIER "u",
+              STAMP_MTIME_LENGTH, get_mtime_ns (&buf));
+  if (pwrite (fd, mtime, STAMP_MTIME_LENGTH, STAMP_MTIME_OFFSET) < 0)
+    udd_verbose_print (_("Could not write cache file stamp: %s\n"),
+                       g_strerror (errno));
+
+  close (fd);
+}
+
+/* Puts the stamp written by write_stamp_file() next to the cache that was
+ * just renamed into dir_fd. Without a new stamp, the previous one is
+ * removed, since it does not describe the new cache. */
+static void
+commit_stamp_file (int   dir_fd,
+                   char *temp_stamp_file)
+{
+  if (temp_stamp_file == NULL)
+    {
+      unlinkat (dir_fd, MIME_CACHE_STAMP_FILENAME, 0);
+      return;
+    }
+
+  if (renameat (dir_fd, temp_stamp_file,
+                dir_fd, MIME_CACHE_STAMP_FILENAME) < 0)
+    {
+      udd_verbose_print (_("Could not write cache file stamp: %s\n"),
+                         g_strerror (errno));
+      unlinkat (dir_fd, temp_stamp_file, 0);
+      unlinkat (dir_fd, MIME_CACHE_STAMP_FILENAME, 0);
+      return;
+    }
+
+  write_directory_mtime (dir_fd);
+}
+
+/* Keeps the stamp that was just written to a temporary file in dir_fd, with
+ * the directories it was computed from, which are taken from
+ * scanned_dirs. */
+static void
+add_written_stamp (int                dir_fd,
+                   const StampHeader *header)
+{
+  WrittenStamp *written;
+  struct stat buf;
+
+  if (fstat (dir_fd, &buf) < 0)
+    return;
+
+  written = g_new (WrittenStamp, 1);
+  written->dir_fd = dup (dir_fd);
+  written->root = current_root;
+  written->dev = buf.st_dev;
+  written->ino = buf.st_ino;
+  written->generation = header->generation;
+  written->checksum = header->checksum;
+  written->scanned_dirs = scanned_dirs;
+  scanned_dirs = NULL;
+
+  g_ptr_array_add (written_stamps, written);
+}
+
+/* Writes the stamp of the directories of written in its stamp file, in
+ * place, if this file is still the one that was written by this run. */
+static void
+rewrite_stamp_value (WrittenStamp *written)
+{
+  StampHeader header;
+  char value[STAMP_VALUE_LENGTH + 1];
+  FILE *f;
+  int fd;
+
+  f = open_stamp_file (written->dir_fd);
+  if (f == NULL)
+    return;
+
+  if (!read_stamp_header (f, &header) ||
+      header.generation != written->generation ||
+      header.checksum != written->checksum)
+    {
+      fclose (f);
+      return;
+    }
+  fclose (f);
+
+  fd = openat (written->dir_fd, MIME_CACHE_STAMP_FILENAME,
+               O_WRONLY | O_NOFOLLOW);
+  if (fd < 0)
+    return;
+
+  g_snprintf (value, sizeof (value), "%0*" G_GINT64_MODIFIER "x",
+              STAMP_VALUE_LENGTH, compute_stamp (written->scanned_dirs));
+  if (pwrite (fd, value, STAMP_VALUE_LENGTH, STAMP_VALUE_OFFSET) < 0)
+    udd_verbose_print (_("Could not write cache file stamp: %s\n"),
+                       g_strerror (errno));
+
+  close (fd);
+}
+
+/* When a directory whose cache was written by this run is a subdirectory of
+ * another one, writing its cache changes its modification time after it was
+ * recorded in the stamp of the other one, which would then never be up to
+ * date. Once all the caches have been renamed, the stamps get the final
+ * modification times of these subdirectories. */
+static void
+update_nested_stamps (void)
+{
+  guint i, j, k;
+
+  for (i = 0; i < written_stamps->len; i++)
+    {
+      WrittenStamp *written = g_ptr_array_index (written_stamps, i);
+      gboolean changed = FALSE;
+
+      for (j = 0; j < written->scanned_dirs->len; j++)
+        {
+          ScannedDirectory *dir = g_ptr_array_index (written->scanned_dirs, j);
+
+          for (k = 0; k < written_stamps->len; k++)
+            {
+              WrittenStamp *nested = g_ptr_array_index (written_stamps, k);
+              struct stat buf;
+
+              if (nested == written || nested->root != written->root ||
+                  nested->dev != dir->dev || nested->ino != dir->ino)
+                continue;
+
+              if (fstat (nested->dir_fd, &buf) == 0 &&
+                  get_mtime_ns (&buf) != dir->mtime)
+                {
+                  dir->mtime = get_mtime_ns (&buf);
+                  changed = TRUE;
+                }
+            }
+        }
+
+      if (changed)
+        rewrite_stamp_value (written);
+    }
+}
+
+static void
+free_written_stamps (void)
+{
+  guint i;
+
+  for (i = 0; i < written_stamps->len; i++)
+    {
+      WrittenStamp *written = g_ptr_array_index (written_stamps, i);
+
+      close (written->dir_fd);
+      free_scanned_directories (written->scanned_dirs);
+      g_free (written);
+    }
+
+  g_ptr_array_free (written_stamps, TRUE);
+  written_stamps = NULL;
+}
+
+/* Tells whether the cache in desktop_dir is up to date, only looking at the
+ * modification times of desktop_dir and of its subdirectories. */
+static CacheState
+get_cache_state (const char *desktop_dir)
+{
+  GPtrArray *dirs;
+  StampHeader stamp;
+  CacheHeader header;
+  struct stat buf;
+  char line[4096];
+  FILE *f;
+  int dir_fd, fd;
+  ssize_t n;
+  CacheState state;
+
+  dir_fd = dfu_open_in_root (root_fd, desktop_dir, O_RDONLY | O_DIRECTORY);
+  if (dir_fd < 0)
+    return CACHE_NO_DIRECTORY;
+
+  state = CACHE_OUT_OF_DATE;
+  dirs = NULL;
+  fd = -1;
+
+  f = open_stamp_file (dir_fd);
+  if (f == NULL)
+    goto out;
+
+  if (fstat (dir_fd, &buf) < 0 ||
+      !read_stamp_header (f, &stamp) ||
+      stamp.mtime != get_mtime_ns (&buf))
+    goto out;
+
+  dirs = g_ptr_array_new ();
+  while (read_stamp_line (f, line, sizeof (line)))
+    {
+      char *path;
+      char *full_path;
+      gboolean found;
+
+      if (!g_str_has_prefix (line, STAMP_DIRECTORY))
+        goto out;
+
+      path = g_strcompress (line + strlen (STAMP_DIRECTORY));
+      full_path = g_build_filename (desktop_dir, path, NULL);
+      found = stat_path (full_path, &buf);
+      g_free (full_path);
+
+      if (found)
+        add_scanned_directory (dirs, path, &buf);
+      g_free (path);
+
+      if (!found)
+        goto out;
+    }
+
+  if (!feof (f) || compute_stamp (dirs) != stamp.stamp)
+    goto out;
+
+  /* the stamp must be the one of this cache; its body is not read, readers
+   * verify its checksum */
+  fd = openat (dir_fd, MIME_CACHE_FILENAME, O_RDONLY | O_NOFOLLOW);
+  if (fd < 0 || fstat (fd, &buf) < 0 || (guint64) buf.st_size != stamp.size)
+    goto out;
+
+  n = pread (fd, line, MIME_CACHE_HEADER_LENGTH, 0);
+  if (n != MIME_CACHE_HEADER_LENGTH)
+    goto out;
+  line[n] = '\0';
+
+  if (parse_cache_header (line, &header) &&
+      header.checksum == stamp.checksum)
+    state = CACHE_UP_TO_DATE;
+
+out:
+  if (dirs != NULL)
+    free_scanned_directories (dirs);
+  if (fd >= 0)
+    close (fd);
+  if (f != NULL)
+    fclose (f);
+  close (dir_fd);
+
+  return state;
+}
+
+static void
+process_desktop_files (const char  *desktop_dir,
+                       const char  *relative_dir,
+                       const char  *prefix,
+                       int          depth,
+                       GError     **error)
+{
+  GError *process_error;
+  DIR *dir;
+  struct dirent *entry;
+  struct stat buf;
+  DirectoryId key, *dir_id;
+  int fd;
+
+  fd = dfu_open_in_root (root_fd, desktop_dir, O_RDONLY | O_DIRECTORY);
+  if (fd < 0 || fstat (fd, &buf) < 0)
+    {
+      int errsv = errno;
+
+      if (fd >= 0)
+        close (fd);
+      g_set_error (error, G_FILE_ERROR,
+                   g_file_error_from_errno (errsv),
+                   "%s", g_strerror (errsv));
+      return;
+    }
+
+  key.dev = buf.st_dev;
+  key.ino = buf.st_ino;
+
+  dir_id = g_hash_table_lookup (visited_dirs, &key);
+  if (dir_id != NULL)
+    {
+      close (fd);
+
+      /* a directory still being scanned is one of our parents: each link
+       * making a loop is only met once, since its parent is only scanned
+       * once */
+      if (dir_id->state == DIRECTORY_IN_PROGRESS)
+        {
+          udd_print (_("Warning: directory \"%s\" is a loop to one of its "
+                       "parent directories, ignoring it\n"), desktop_dir);
+        }
+      else
+        {
+          udd_verbose_print (_("Directory \"%s\" has already been "
+                               "processed, ignoring it\n"), desktop_dir);
+        }
+      return;
+    }
+
+  dir = fdopendir (fd);
+  if (dir == NULL)
+    {
+      int errsv = errno;
+
+      close (fd);
+      g_set_error (error, G_FILE_ERROR,
+                   g_file_error_from_errno (errsv),
+                   "%s", g_strerror (errsv));
+      return;
+    }
+
+  dir_id = g_new (DirectoryId, 1);
+  *dir_id = key;
+  dir_id->state = DIRECTORY_IN_PROGRESS;
+  g_hash_table_insert (visited_dirs, dir_id, dir_id);
+  stats.n_directories++;
+
+  /* the directory of the cache is checked differently, see write_stamp() */
+  if (relative_dir[0] != '\0')
+    add_scanned_directory (scanned_dirs, relative_dir, &buf);
+
+  while (spill_error == NULL && (entry = readdir (dir)) != NULL)
+    {
+      const char *filename = entry->d_name;
+      char *full_path, *name;
+      gboolean is_dir;
+
+      if (strcmp (filename, ".") == 0 || strcmp (filename, "..") == 0)
+        continue;
+
+      full_path = g_build_filename (desktop_dir, filename, NULL);
+
+      /* only symbolic links (and file systems not giving the type of
+       * entries) need a stat() */
+#ifdef _DIRENT_HAVE_D_TYPE
+      if (entry->d_type == DT_DIR)
+        is_dir = TRUE;
+      else if (entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN)
+        is_dir = FALSE;
+      else
+#endif
+        is_dir = path_is_directory (full_path);
+
+      if (is_dir)
+        {
+          char *sub_prefix, *sub_relative_dir;
+
+          if (max_depth >= 0 && depth >= max_depth)
+            {
+              udd_verbose_print (_("Directory \"%s\" is deeper than the "
+                                   "maximum depth, ignoring it\n"),
+                                 full_path);
+              g_free (full_path);
+              continue;
+            }
+
+          sub_prefix = g_strdup_printf ("%s%s-", prefix, filename);
+          if (relative_dir[0] == '\0')
+            sub_relative_dir = g_strdup (filename);
+          else
+            sub_relative_dir = g_build_filename (relative_dir, filename, NULL);
+
+          process_error = NULL;
+          process_desktop_files (full_path, sub_relative_dir, sub_prefix,
+                                 depth + 1, &process_error);
+          g_free (sub_relative_dir);
+          g_free (sub_prefix);
+
+          if (process_error != NULL)
+            {
+              udd_verbose_print (_("Could not process directory \"%s\": %s\n"),
+                                 full_path, process_error->message);
+              g_error_free (process_error);
+            }
+          g_free (full_path);
+          continue;
+        }
+      else if (!g_str_has_suffix (filename, ".desktop"))
+        {
+          g_free (full_path);
+          continue;
+        }
+
+      name = g_strdup_printf ("%s%s", prefix, filename);
+      queue_desktop_file (full_path, name);
+    }
+
+  closedir (dir);
+
+  dir_id->state = DIRECTORY_DONE;
 }
 
 static FILE *
-open_temp_cache_file (const char *dir, char **filename, GError **error)
+open_temp_cache_file (int dir_fd, char **filename, GError **error)
 {
-  int fd;
+  static const char letters[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+  int fd, i, j;
   char *file;
   FILE *fp;
-  mode_t mask;
 
-  file = g_build_filename (dir, TEMP_CACHE_FILENAME_PREFIX, NULL);
-  fd = g_mkstemp (file);
+  file = NULL;
+  fd = -1;
+  errno = EEXIST;
+  for (i = 0; i < 100 && fd < 0 && errno == EEXIST; i++)
+    {
+      g_free (file);
+      file = g_strdup (TEMP_CACHE_FILENAME_PREFIX "XXXXXX");
+      for (j = strlen (file) - 6; file[j] != '\0'; j++)
+        file[j] = letters[g_random_int_range (0, sizeof (letters) - 1)];
+
+      fd = openat (dir_fd, file, O_RDWR | O_CREAT | O_EXCL, 0666);
+    }
+
+  if (fd < 0)
+    {
+      g_set_error (error, G_FILE_ERROR,
+                   g_file_error_from_errno (errno),
+                   "%s", g_strerror (errno));
+      g_free (file);
+      return NULL;
+    }
+
+  fp = fdopen (fd, "w+");
+  if (fp == NULL)
+    {
+      g_set_error (error, G_FILE_ERROR,
+                   g_file_error_from_errno (errno),
+                   "%s", g_strerror (errno));
+      unlinkat (dir_fd, file, 0);
+      g_free (file);
+      close (fd);
+      return NULL;
+    }
+
+  if (filename)
+    *filename = file;
+  else
+    g_free (file);
+
+  return fp;
+}
+
+static void
+add_mime_type (const char      *mime_type,
+               DesktopFileList *desktop_files,
+               FILE            *f)
+{
+  fputs (mime_type, f);
+  fputc ('=', f);
+  fputs (desktop_file_list_get_value (desktop_files), f);
+  fputc ('\n', f);
+}
+
+static void
+add_desktop_id (const char *desktop_id,
+                GList      *mime_types,
+                FILE       *f)
+{
+  GList *mime_type;
+
+  fputs (desktop_id, f);
+  fputc ('=', f);
+  for (mime_type = mime_types; mime_type != NULL; mime_type = mime_type->next)
+    {
+      fputs ((const char *) mime_type->data, f);
+      fputc (';', f);
+    }
+  fputc ('\n', f);
+}
+
+/* GKeyFile refuses to load a file containing an invalid key name, even in a
+ * group it is not asked about: skip desktop IDs that would make the whole
+ * cache unreadable for existing readers. */
+static gboolean
+desktop_id_is_valid_key (const char *desktop_id)
+{
+  if (desktop_id[0] == '#' || g_ascii_isspace (desktop_id[0]))
+    return FALSE;
+
+  return strpbrk (desktop_id, "=[]\n") == NULL;
+}
+
+static void
+add_reverse_index (GList *mime_types, FILE *f)
+{
+  GHashTable *desktop_ids_map;
+  GList *mime_type, *desktop_ids, *desktop_id;
+  DesktopFileList *desktop_file;
+
+  /* desktop file IDs are interned */
+  desktop_ids_map = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  /* mime types are sorted, so each list of mime types is built sorted
+   * (prepended, and reversed below) */
+  for (mime_type = mime_types; mime_type != NULL; mime_type = mime_type->next)
+    for (desktop_file = g_hash_table_lookup (mime_types_map, mime_type->data);
+         desktop_file != NULL;
+         desktop_file = desktop_file->next)
+      {
+        GList *list;
+
+        list = g_hash_table_lookup (desktop_ids_map,
+                                    desktop_file->desktop_file);
+        if (list && list->data == mime_type->data)
+          continue;
+
+        list = g_list_prepend (list, mime_type->data);
+        g_hash_table_replace (desktop_ids_map,
+                              (gpointer) desktop_file->desktop_file, list);
+      }
+
+  desktop_ids = g_hash_table_get_keys (desktop_ids_map);
+  desktop_ids = g_list_sort (desktop_ids, (GCompareFunc) g_strcmp0);
+
+  for (desktop_id = desktop_ids;
+       desktop_id != NULL;
+       desktop_id = desktop_id->next)
+    {
+      GList *list;
+
+      list = g_hash_table_lookup (desktop_ids_map, desktop_id->data);
+      list = g_list_reverse (list);
+
+      if (desktop_id_is_valid_key (desktop_id->data))
+        add_desktop_id (desktop_id->data, list, f);
+      else
+        udd_verbose_print (_("Desktop file \"%s\" cannot be added to the "
+                             "reverse index\n"),
+                           (const char *) desktop_id->data);
+
+      g_list_free (list);
+    }
+
+  g_list_free (desktop_ids);
+  g_hash_table_destroy (desktop_ids_map);
+}
+
+static GList *
+get_sorted_mime_types (void)
+{
+  GList *keys;
+
+  keys = g_hash_table_get_keys (mime_types_map);
+
+  return g_list_sort (keys, (GCompareFunc) g_strcmp0);
+}
+
+static void
+add_mime_types (GList *mime_types, FILE *f)
+{
+  GList *key;
+
+  for (key = mime_types; key != NULL; key = key->next)
+    add_mime_type (key->data,
+                   g_hash_table_lookup (mime_types_map, key->data),
+                   f);
+}
+
+static void
+init_maps (void)
+{
+  mime_types_map = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          (GDestroyNotify)g_free,
+                                          NULL);
+  desktop_file_lists = g_hash_table_new_full (desktop_file_list_hash,
+                                              desktop_file_list_equal,
+                                              (GDestroyNotify)desktop_file_list_free,
+                                              NULL);
+  desktop_file_ids = g_string_chunk_new (4096);
+  memory_used = 0;
+}
+
+static void
+free_maps (void)
+{
+  g_hash_table_destroy (mime_types_map);
+  g_hash_table_destroy (desktop_file_lists);
+  g_string_chunk_free (desktop_file_ids);
+}
+
+static FILE *
+open_run_file (GError **error)
+{
+  FILE *f;
+  char *filename;
+
+  filename = NULL;
+  f = open_temp_cache_file (cache_dir_fd, &filename, error);
+  if (f == NULL)
+    return NULL;
+
+  /* the file only needs to live as long as it is open */
+  unlinkat (cache_dir_fd, filename, 0);
+  g_free (filename);
+
+  return f;
+}
+
+static gboolean
+finish_run_file (FILE *f, GError **error)
+{
+  if (fflush (f) != 0 || ferror (f))
+    {
+      g_set_error (error, G_FILE_ERROR,
+                   g_file_error_from_errno (errno),
+                   _("Temporary file could not be written: %s"),
+                   g_strerror (errno));
+      return FALSE;
+    }
+
+  rewind (f);
+
+  return TRUE;
+}
+
+/* Writes the content of the maps to new runs, and empties the maps. */
+static void
+spill_maps (GError **error)
+{
+  Phase previous_phase;
+  GList *keys;
+  FILE *f, *reverse_f;
+
+  previous_phase = stats_switch (PHASE_SPILL);
+  keys = get_sorted_mime_types ();
+  f = reverse_f = NULL;
+
+  f = open_run_file (error);
+  if (f == NULL)
+    goto out;
+
+  add_mime_types (keys, f);
+  if (!finish_run_file (f, error))
+    goto out;
+
+  if (reverse_index)
+    {
+      reverse_f = open_run_file (error);
+      if (reverse_f == NULL)
+        goto out;
+
+      add_reverse_index (keys, reverse_f);
+      if (!finish_run_file (reverse_f, error))
+        goto out;
+    }
+
+  udd_verbose_print (_("Wrote %u MIME types to a temporary file\n"),
+                     g_list_length (keys));
+
+  g_ptr_array_add (mime_type_runs, f);
+  f = NULL;
+  if (reverse_f != NULL)
+    {
+      g_ptr_array_add (desktop_id_runs, reverse_f);
+      reverse_f = NULL;
+    }
+
+out:
+  if (f != NULL)
+    fclose (f);
+  if (reverse_f != NULL)
+    fclose (reverse_f);
+  g_list_free (keys);
+
+  free_maps ();
+  init_maps ();
+
+  stats_switch (previous_phase);
+}
+
+typedef struct {
+  FILE    *f;
+  GString *line;
+  gsize    key_length;
+} MergeRun;
+
+/* Reads the next "key=value" line of run, without its trailing newline. */
+static gboolean
+merge_run_next_line (MergeRun *run)
+{
+  char buf[4096];
+  char *equal;
+
+  g_string_truncate (run->line, 0);
+
+  while (fgets (buf, sizeof (buf), run->f) != NULL)
+    {
+      g_string_append (run->line, buf);
+      if (run->line->len > 0 && run->line->str[run->line->len - 1] == '\n')
+        break;
+    }
+
+  if (run->line->len == 0)
+    return FALSE;
+
+  if (run->line->str[run->line->len - 1] == '\n')
+    g_string_truncate (run->line, run->line->len - 1);
+
+  equal = strchr (run->line->str, '=');
+  if (equal == NULL)
+    run->key_length = run->line->len;
+  else
+    run->key_length = equal - run->line->str;
+
+  return TRUE;
+}
+
+static int
+merge_run_compare_key (MergeRun   *run,
+                       const char *key,
+                       gsize       key_length)
+{
+  int cmp;
+
+  cmp = memcmp (run->line->str, key, MIN (run->key_length, key_length));
+  if (cmp != 0)
+    return cmp;
+
+  if (run->key_length == key_length)
+    return 0;
+
+  return run->key_length < key_length ? -1 : 1;
+}
+
+/* Merges the sorted ";"-terminated list value into the sorted list merged,
+ * keeping only one copy of the items found in both. */
+static void
+merge_values (GString *merged, const char *value, GString *tmp)
+{
+  const char *a, *b, *a_end, *b_end;
+
+  g_string_truncate (tmp, 0);
+
+  a = merged->str;
+  b = value;
+
+  while (*a != '\0' || *b != '\0')
+    {
+      int cmp;
+      gsize a_len, b_len;
+
+      a_end = strchr (a, ';');
+      if (a_end == NULL)
+        a_end = a + strlen (a);
+      b_end = strchr (b, ';');
+      if (b_end == NULL)
+        b_end = b + strlen (b);
+
+      a_len = a_end - a;
+      b_len = b_end - b;
+
+      if (*a == '\0')
+        cmp = 1;
+      else if (*b == '\0')
+        cmp = -1;
+      else
+        {
+          cmp = memcmp (a, b, MIN (a_len, b_len));
+          if (cmp == 0 && a_len != b_len)
+            cmp = a_len < b_len ? -1 : 1;
+        }
+
+      if (cmp <= 0)
+        {
+          g_string_append_len (tmp, a, a_len);
+          a = *a_end ? a_end + 1 : a_end;
+        }
+      else
+        g_string_append_len (tmp, b, b_len);
+
+      if (cmp >= 0)
+        b = *b_end ? b_end + 1 : b_end;
+
+      g_string_append_c (tmp, ';');
+    }
+
+  g_string_assign (merged, tmp->str);
+}
+
+/* Merges n_runs runs into f: each run is sorted by key, so the smallest
+ * current key of all runs is the next key to write, and its value is the
+ * merge of the values of this key in all runs. Returns the number of keys
+ * written. */
+static guint
+merge_run_files (FILE **files, guint n_runs, FILE *f)
+{
+  MergeRun *runs;
+  GString *key, *value, *tmp;
+  guint i, n_active, n_keys;
+
+  runs = g_new (MergeRun, n_runs);
+  n_active = 0;
+  for (i = 0; i < n_runs; i++)
+    {
+      runs[n_active].f = files[i];
+      runs[n_active].line = g_string_new (NULL);
+      if (merge_run_next_line (&runs[n_active]))
+        n_active++;
+      else
+        g_string_free (runs[n_active].line, TRUE);
+    }
+
+  key = g_string_new (NULL);
+  value = g_string_new (NULL);
+  tmp = g_string_new (NULL);
+  n_keys = 0;
+
+  while (n_active > 0)
+    {
+      guint min;
+
+      min = 0;
+      for (i = 1; i < n_active; i++)
+        if (merge_run_compare_key (&runs[i], runs[min].line->str,
+                                   runs[min].key_length) < 0)
+          min = i;
+
+      g_string_truncate (key, 0);
+      g_string_append_len (key, runs[min].line->str, runs[min].key_length);
+      g_string_truncate (value, 0);
+
+      i = 0;
+      while (i < n_active)
+        {
+          const char *run_value;
+
+          if (merge_run_compare_key (&runs[i], key->str, key->len) != 0)
+            {
+              i++;
+              continue;
+            }
+
+          run_value = runs[i].line->str + runs[i].key_length;
+          if (*run_value == '=')
+            run_value++;
+          merge_values (value, run_value, tmp);
+
+          if (merge_run_next_line (&runs[i]))
+            i++;
+          else
+            {
+              g_string_free (runs[i].line, TRUE);
+              runs[i] = runs[--n_active];
+            }
+        }
+
+      fputs (key->str, f);
+      fputc ('=', f);
+      fputs (value->str, f);
+      fputc ('\n', f);
+      n_keys++;
+    }
+
+  g_string_free (tmp, TRUE);
+  g_string_free (value, TRUE);
+  g_string_free (key, TRUE);
+  g_free (runs);
+
+  return n_keys;
+}
+
+/* Merges all runs into f, first merging them MAX_MERGED_RUNS at a time
+ * into bigger runs if there are too many of them. The runs are closed.
+ * Returns the number of keys written to f. */
+static guint
+merge_runs (GPtrArray *runs, FILE *f, GError **error)
+{
+  guint n_keys;
+
+  while (runs->len > MAX_MERGED_RUNS)
+    {
+      FILE *merged;
+      guint i;
+
+      merged = open_run_file (error);
+      if (merged == NULL)
+        return 0;
+
+      merge_run_files ((FILE **) runs->pdata, MAX_MERGED_RUNS, merged);
+
+      for (i = 0; i < MAX_MERGED_RUNS; i++)
+        fclose (g_ptr_array_index (runs, i));
+      g_ptr_array_remove_range (runs, 0, MAX_MERGED_RUNS);
+
+      if (!finish_run_file (merged, error))
+        {
+          fclose (merged);
+          return 0;
+        }
+
+      g_ptr_array_add (runs, merged);
+    }
+
+  n_keys = merge_run_files ((FILE **) runs->pdata, runs->len, f);
+
+  g_ptr_array_foreach (runs, (GFunc) fclose, NULL);
+  g_ptr_array_set_size (runs, 0);
+
+  return n_keys;
+}
+
+static void
+close_runs (GPtrArray *runs)
+{
+  g_ptr_array_foreach (runs, (GFunc) fclose, NULL);
+  g_ptr_array_free (runs, TRUE);
+}
+
+static void
+sync_database (const char *dir, GError **error)
+{
+  GError *sync_error;
+  char *temp_cache_file, *temp_stamp_file, *cache_file;
+  FILE *tmp_file;
+  GList *keys;
+  CacheHeader header;
+  StampHeader stamp;
+  off_t body_offset;
+  struct stat buf;
+
+  sync_error = NULL;
+
+  /* once some runs have been written, everything goes through the runs */
+  if (mime_type_runs->len > 0 && g_hash_table_size (mime_types_map) > 0)
+    {
+      spill_maps (&sync_error);
+      if (sync_error != NULL)
+        {
+          g_propagate_error (error, sync_error);
+          return;
+        }
+    }
+
+  temp_cache_file = NULL;
+  tmp_file = open_temp_cache_file (cache_dir_fd, &temp_cache_file, &sync_error);
+
+  if (sync_error != NULL)
+    {
+      g_propagate_error (error, sync_error);
+      return;
+    }
+
+  header.version = MIME_CACHE_HEADER_VERSION;
+  header.n_entries = 0;
+  header.checksum = 0;
+  write_cache_header (tmp_file, &header);
+
+  body_offset = ftell (tmp_file);
+  fputs ("[" MIME_CACHE_GROUP "]\n", tmp_file);
+
+  if (mime_type_runs->len > 0)
+    {
+      stats.n_mime_types = merge_runs (mime_type_runs, tmp_file, &sync_error);
+
+      if (sync_error == NULL && reverse_index)
+        {
+          fputs ("[" MIME_CACHE_REVERSE_GROUP "]\n", tmp_file);
+          merge_runs (desktop_id_runs, tmp_file, &sync_error);
+        }
+    }
+  else
+    {
+      keys = get_sorted_mime_types ();
+      stats.n_mime_types = g_list_length (keys);
+
+      add_mime_types (keys, tmp_file);
+
+      if (reverse_index)
+        {
+          fputs ("[" MIME_CACHE_REVERSE_GROUP "]\n", tmp_file);
+          add_reverse_index (keys, tmp_file);
+        }
+
+      g_list_free (keys);
+    }
 
-  if (fd < 0)
+  if (sync_error == NULL)
     {
-      g_set_error (error, G_FILE_ERROR,
-                   g_file_error_from_errno (errno),
-                   "%s", g_strerror (errno));
-      g_free (file);
-      return NULL;
+      header.n_entries = stats.n_mime_types;
+
+      if (fflush (tmp_file) != 0 ||
+          !compute_checksum (fileno (tmp_file), body_offset,
+                             &header.checksum) ||
+          fseek (tmp_file, 0, SEEK_SET) < 0)
+        g_set_error (&sync_error, G_FILE_ERROR,
+                     g_file_error_from_errno (errno),
+                     _("Cache file could not be written: %s"),
+                     g_strerror (errno));
+      else
+        write_cache_header (tmp_file, &header);
     }
 
-  mask = umask(0);
-  (void) umask (mask);
+  if (sync_error == NULL)
+    {
+      if (fflush (tmp_file) != 0 ||
+          (sync_policy == SYNC_FILE && fsync (fileno (tmp_file)) < 0) ||
+          fstat (fileno (tmp_file), &buf) < 0)
+        g_set_error (&sync_error, G_FILE_ERROR,
+                     g_file_error_from_errno (errno),
+                     _("Cache file could not be written: %s"),
+                     g_strerror (errno));
+    }
 
-  fchmod (fd, 0666 & ~mask);
+  fclose (tmp_file);
 
-  fp = fdopen (fd, "w+");
-  if (fp == NULL)
+  if (sync_error != NULL)
     {
-      g_set_error (error, G_FILE_ERROR,
-                   g_file_error_from_errno (errno),
-                   "%s", g_strerror (errno));
-      g_free (file);
-      close (fd);
-      return NULL;
+      g_propagate_error (error, sync_error);
+      unlinkat (cache_dir_fd, temp_cache_file, 0);
+      g_free (temp_cache_file);
+      return;
     }
 
-  if (filename)
-    *filename = file;
-  else
-    g_free (file);
+  stamp.generation = get_cache_generation (cache_dir_fd) + 1;
+  stamp.checksum = header.checksum;
+  stamp.size = buf.st_size;
+  temp_stamp_file = write_stamp_file (cache_dir_fd, &stamp);
+  if (temp_stamp_file != NULL)
+    add_written_stamp (cache_dir_fd, &stamp);
 
-  return fp;
-}
+  cache_file = g_build_filename (dir, MIME_CACHE_FILENAME, NULL);
 
-static void
-add_mime_type (const char *mime_type, GList *desktop_files, FILE *f)
-{
-  GString *list;
-  GList *desktop_file;
+  if (sync_policy == SYNC_BATCH)
+    {
+      PendingCacheFile *pending;
+
+      pending = g_new (PendingCacheFile, 1);
+      pending->dir_fd = dup (cache_dir_fd);
+      pending->temp_file = temp_cache_file;
+      pending->temp_stamp_file = temp_stamp_file;
+      pending->cache_file = cache_file;
+      pending->dev = buf.st_dev;
+      pending->root = current_root;
+      g_ptr_array_add (pending_cache_files, pending);
+      return;
+    }
 
-  list = g_string_new (mime_type);
-  g_string_append_c (list, '=');
-  for (desktop_file = desktop_files;
-       desktop_file != NULL;
-       desktop_file = desktop_file->next)
+  if (renameat (cache_dir_fd, temp_cache_file,
+                cache_dir_fd, MIME_CACHE_FILENAME) < 0)
     {
-      g_string_append (list, (const char *) desktop_file->data);
-      g_string_append_c (list, ';');
+      g_set_error (error, G_FILE_ERROR,
+                   g_file_error_from_errno (errno),
+                   _("Cache file \"%s\" could not be written: %s"),
+                   cache_file, g_strerror (errno));
+
+      unlinkat (cache_dir_fd, temp_cache_file, 0);
+      if (temp_stamp_file != NULL)
+        unlinkat (cache_dir_fd, temp_stamp_file, 0);
     }
-  g_string_append_c (list, '\n');
+  else
+    {
+      if (sync_policy == SYNC_FILE && fsync (cache_dir_fd) < 0)
+        udd_verbose_print (_("Could not flush directory \"%s\" to disk: %s\n"),
+                           dir, g_strerror (errno));
 
-  fputs (list->str, f);
+      commit_stamp_file (cache_dir_fd, temp_stamp_file);
+    }
 
-  g_string_free (list, TRUE);
+  g_free (temp_cache_file);
+  g_free (temp_stamp_file);
+  g_free (cache_file);
 }
 
+/* Flushes the file systems of the pending cache files, then renames them. */
 static void
-sync_database (const char *dir, GError **error)
+commit_pending_cache_files (void)
 {
-  GError *sync_error;
-  char *temp_cache_file, *cache_file;
-  FILE *tmp_file;
-  GList *keys, *key;
+  GArray *failed_devs;
+  guint i, j;
 
-  temp_cache_file = NULL;
-  sync_error = NULL;
-  tmp_file = open_temp_cache_file (dir, &temp_cache_file, &sync_error);
+  failed_devs = g_array_new (FALSE, FALSE, sizeof (dev_t));
 
-  if (sync_error != NULL)
-    {
-      g_propagate_error (error, sync_error);
-      return;
-    }
+#ifdef HAVE_SYNCFS
+  {
+    GArray *synced_devs;
 
-  fputs ("[MIME Cache]\n", tmp_file);
+    synced_devs = g_array_new (FALSE, FALSE, sizeof (dev_t));
 
-  keys = g_hash_table_get_keys (mime_types_map);
-  keys = g_list_sort (keys, (GCompareFunc) g_strcmp0);
+    for (i = 0; i < pending_cache_files->len; i++)
+      {
+        PendingCacheFile *pending;
 
-  for (key = keys; key != NULL; key = key->next)
-    add_mime_type (key->data,
-                   g_hash_table_lookup (mime_types_map, key->data),
-                   tmp_file);
+        pending = g_ptr_array_index (pending_cache_files, i);
 
-  g_list_free (keys);
-  fclose (tmp_file);
+        for (j = 0; j < synced_devs->len; j++)
+          if (g_array_index (synced_devs, dev_t, j) == pending->dev)
+            break;
+        if (j < synced_devs->len)
+          continue;
+
+        g_array_append_val (synced_devs, pending->dev);
+
+        if (syncfs (pending->dir_fd) < 0)
+          {
+            udd_print (_("Could not flush \"%s\" to disk: %s\n"),
+                       pending->cache_file, g_strerror (errno));
+            g_array_append_val (failed_devs, pending->dev);
+          }
+      }
+
+    g_array_free (synced_devs, TRUE);
+  }
+#else
+  sync ();
+#endif
 
-  cache_file = g_build_filename (dir, CACHE_FILENAME, NULL);
-  if (rename (temp_cache_file, cache_file) < 0)
+  for (i = 0; i < pending_cache_files->len; i++)
     {
-      g_set_error (error, G_FILE_ERROR,
-                   g_file_error_from_errno (errno),
-                   _("Cache file \"%s\" could not be written: %s"),
-                   cache_file, g_strerror (errno));
+      PendingCacheFile *pending;
+
+      pending = g_ptr_array_index (pending_cache_files, i);
+
+      for (j = 0; j < failed_devs->len; j++)
+        if (g_array_index (failed_devs, dev_t, j) == pending->dev)
+          break;
 
-      unlink (temp_cache_file);
+      if (j < failed_devs->len)
+        {
+          unlinkat (pending->dir_fd, pending->temp_file, 0);
+          if (pending->temp_stamp_file != NULL)
+            unlinkat (pending->dir_fd, pending->temp_stamp_file, 0);
+          pending->root->n_updated_dirs--;
+        }
+      else if (renameat (pending->dir_fd, pending->temp_file,
+                         pending->dir_fd, MIME_CACHE_FILENAME) < 0)
+        {
+          udd_print (_("Cache file \"%s\" could not be written: %s\n"),
+                     pending->cache_file, g_strerror (errno));
+          unlinkat (pending->dir_fd, pending->temp_file, 0);
+          if (pending->temp_stamp_file != NULL)
+            unlinkat (pending->dir_fd, pending->temp_stamp_file, 0);
+          pending->root->n_updated_dirs--;
+        }
+      else
+        commit_stamp_file (pending->dir_fd, pending->temp_stamp_file);
+
+      close (pending->dir_fd);
+      g_free (pending->temp_file);
+      g_free (pending->temp_stamp_file);
+      g_free (pending->cache_file);
+      g_free (pending);
     }
-  g_free (temp_cache_file);
-  g_free (cache_file);
+
+  g_ptr_array_set_size (pending_cache_files, 0);
+  g_array_free (failed_devs, TRUE);
 }
 
 static void
@@ -371,24 +2491,70 @@ update_database (const char  *desktop_dir,
                  GError     **error)
 {
   GError *update_error;
+  guint64 n_syscalls;
 
-  mime_types_map = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                          (GDestroyNotify)g_free,
-                                          NULL);
+  memset (&stats, 0, sizeof (stats));
+  stats_desktop_dir = desktop_dir;
+  stats_update_start = get_clock_ns (CLOCK_MONOTONIC);
+
+  /* the cache file is written in this directory, whatever its path
+   * resolves to later */
+  cache_dir_fd = dfu_open_in_root (root_fd, desktop_dir,
+                                   O_RDONLY | O_DIRECTORY);
+  if (cache_dir_fd < 0)
+    {
+      g_set_error (error, G_FILE_ERROR,
+                   g_file_error_from_errno (errno),
+                   "%s", g_strerror (errno));
+      return;
+    }
+
+  stats_switch (PHASE_ENUMERATE);
+  n_syscalls = dfu_file_reader_get_n_syscalls (file_reader);
+
+  init_maps ();
+  init_diagnostics ();
+  scanned_dirs = g_ptr_array_new ();
+  visited_dirs = g_hash_table_new_full (directory_id_hash, directory_id_equal,
+                                        g_free, NULL);
+  mime_type_runs = g_ptr_array_new ();
+  desktop_id_runs = g_ptr_array_new ();
 
   update_error = NULL;
-  process_desktop_files (desktop_dir, "", &update_error);
+  process_desktop_files (desktop_dir, "", "", 0, &update_error);
+  process_batch ();
+  flush_diagnostics ();
+
+  if (spill_error != NULL)
+    {
+      if (update_error == NULL)
+        update_error = spill_error;
+      else
+        g_error_free (spill_error);
+      spill_error = NULL;
+    }
 
   if (update_error != NULL)
     g_propagate_error (error, update_error);
   else
     {
+      stats_switch (PHASE_WRITE);
       sync_database (desktop_dir, &update_error);
       if (update_error != NULL)
         g_propagate_error (error, update_error);
     }
-  g_hash_table_foreach (mime_types_map, (GHFunc) list_free_deep, NULL);
-  g_hash_table_destroy (mime_types_map);
+  free_maps ();
+  g_hash_table_destroy (visited_dirs);
+  if (scanned_dirs != NULL)
+    free_scanned_directories (scanned_dirs);
+  scanned_dirs = NULL;
+  close_runs (mime_type_runs);
+  close_runs (desktop_id_runs);
+  close (cache_dir_fd);
+  cache_dir_fd = -1;
+
+  stats.n_syscalls = dfu_file_reader_get_n_syscalls (file_reader) - n_syscalls;
+  stats_switch (PHASE_NONE);
 }
 
 static const char **
@@ -425,6 +2591,275 @@ print_desktop_dirs (const char **dirs)
   g_free (directories);
 }
 
+/* Makes the I/O and CPU usage of this process get out of the way of other
+ * processes. This must be called before starting any thread, since the
+ * priorities of a thread are inherited by the threads it creates. */
+static void
+set_background_priority (void)
+{
+#if defined (HAVE_LINUX_IOPRIO_H) && defined (__NR_ioprio_set)
+  if (syscall (__NR_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+               IOPRIO_PRIO_VALUE (IOPRIO_CLASS_IDLE, 0)) < 0)
+    udd_verbose_print (_("Could not set idle I/O priority: %s\n"),
+                       g_strerror (errno));
+#endif
+
+  if (setpriority (PRIO_PROCESS, 0, 19) < 0)
+    udd_verbose_print (_("Could not set low CPU priority: %s\n"),
+                       g_strerror (errno));
+}
+
+static gboolean
+parse_io_backend (const char  *option_name,
+                  const char  *value,
+                  gpointer     data,
+                  GError     **error)
+{
+  if (!dfu_file_reader_backend_from_string (value, &io_backend))
+    {
+      g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                   _("Invalid I/O backend \"%s\""), value);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+parse_sync (const char  *option_name,
+            const char  *value,
+            gpointer     data,
+            GError     **error)
+{
+  if (strcmp (value, "none") == 0)
+    sync_policy = SYNC_NONE;
+  else if (strcmp (value, "file") == 0)
+    sync_policy = SYNC_FILE;
+  else if (strcmp (value, "batch") == 0)
+    sync_policy = SYNC_BATCH;
+  else
+    {
+      g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                   _("Invalid sync policy \"%s\""), value);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+parse_stats (const char  *option_name,
+             const char  *value,
+             gpointer     data,
+             GError     **error)
+{
+  if (value == NULL || strcmp (value, "text") == 0)
+    stats_format = STATS_TEXT;
+  else if (strcmp (value, "json") == 0)
+    stats_format = STATS_JSON;
+  else
+    {
+      g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                   _("Invalid statistics format \"%s\""), value);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+parse_max_memory (const char  *option_name,
+                  const char  *value,
+                  gpointer     data,
+                  GError     **error)
+{
+  guint64 size;
+  guint64 factor;
+  char *end;
+
+  errno = 0;
+  size = g_ascii_strtoull (value, &end, 10);
+
+  switch (g_ascii_toupper (*end))
+    {
+      case 'G':
+        factor = 1024 * 1024 * 1024;
+        end++;
+        break;
+      case 'M':
+        factor = 1024 * 1024;
+        end++;
+        break;
+      case 'K':
+        factor = 1024;
+        end++;
+        break;
+      default:
+        factor = 1;
+        break;
+    }
+
+  if (end == value || *end != '\0' || errno == ERANGE || size == 0 ||
+      size > G_MAXSIZE / factor)
+    {
+      g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                   _("Invalid memory size \"%s\""), value);
+      return FALSE;
+    }
+
+  max_memory = size * factor;
+
+  return TRUE;
+}
+
+static void
+add_root (GPtrArray  *roots,
+          const char *path)
+{
+  Root *root;
+
+  root = g_new0 (Root, 1);
+  root->path = g_strdup (path);
+  g_ptr_array_add (roots, root);
+}
+
+/* Returns the roots given with --root and --root-list, or a single root
+ * with a NULL path if there are none. */
+static GPtrArray *
+get_roots (char       **root_args,
+           const char  *root_list,
+           GError     **error)
+{
+  GPtrArray *roots;
+  int i;
+
+  roots = g_ptr_array_new ();
+
+  for (i = 0; root_args != NULL && root_args[i] != NULL; i++)
+    add_root (roots, root_args[i]);
+
+  if (root_list != NULL)
+    {
+      char *contents;
+      char **lines;
+
+      if (!g_file_get_contents (root_list, &contents, NULL, error))
+        return roots;
+
+      lines = g_strsplit (contents, "\n", -1);
+      for (i = 0; lines[i] != NULL; i++)
+        {
+          g_strstrip (lines[i]);
+          if (lines[i][0] != '\0' && lines[i][0] != '#')
+            add_root (roots, lines[i]);
+        }
+
+      g_strfreev (lines);
+      g_free (contents);
+    }
+
+  if (roots->len == 0)
+    add_root (roots, NULL);
+
+  return roots;
+}
+
+/* Returns dir, inside root, for messages. */
+static char *
+get_display_dir (Root       *root,
+                 const char *dir)
+{
+  if (root->path == NULL)
+    return g_strdup (dir);
+
+  return g_build_filename (root->path, dir, NULL);
+}
+
+static void
+update_root (Root        *root,
+             const char **desktop_dirs)
+{
+  GError *error;
+  int i;
+
+  if (root->path != NULL)
+    {
+      root_fd = open (root->path, O_RDONLY | O_DIRECTORY);
+      if (root_fd < 0)
+        {
+          udd_print (_("Could not open root directory \"%s\": %s\n"),
+                     root->path, g_strerror (errno));
+          return;
+        }
+
+      udd_verbose_print (_("Processing root directory \"%s\"\n"),
+                         root->path);
+    }
+
+  current_root = root;
+  dfu_file_reader_set_root (file_reader, root_fd);
+
+  for (i = 0; desktop_dirs[i] != NULL; i++)
+    {
+      char *display_dir;
+
+      display_dir = get_display_dir (root, desktop_dirs[i]);
+
+      if (check || if_stale)
+        {
+          CacheState state;
+
+          state = get_cache_state (desktop_dirs[i]);
+
+          if (state == CACHE_UP_TO_DATE)
+            {
+              udd_verbose_print (_("Cache file in \"%s\" is up to date\n"),
+                                 display_dir);
+              root->n_updated_dirs++;
+              g_free (display_dir);
+              continue;
+            }
+
+          if (check)
+            {
+              if (state == CACHE_OUT_OF_DATE)
+                {
+                  udd_verbose_print (_("Cache file in \"%s\" is out of "
+                                       "date\n"), display_dir);
+                  n_out_of_date_caches++;
+                }
+              g_free (display_dir);
+              continue;
+            }
+        }
+
+      error = NULL;
+      update_database (desktop_dirs[i], &error);
+
+      if (stats_format != STATS_NONE)
+        print_stats (display_dir, error);
+
+      if (error != NULL)
+        {
+          udd_verbose_print (_("Could not create cache file in \"%s\": %s\n"),
+                             display_dir, error->message);
+          g_error_free (error);
+        }
+      else
+        root->n_updated_dirs++;
+
+      g_free (display_dir);
+    }
+
+  if (root_fd >= 0)
+    {
+      close (root_fd);
+      root_fd = -1;
+    }
+  dfu_file_reader_set_root (file_reader, -1);
+  current_root = NULL;
+}
+
 int
 main (int    argc,
       char **argv)
@@ -432,8 +2867,11 @@ main (int    argc,
   GError *error;
   GOptionContext *context;
   const char **desktop_dirs;
+  char **root_args;
+  char *root_list;
+  GPtrArray *roots;
+  gboolean failed;
   int i;
-  gboolean found_processable_dir;
 
   const GOptionEntry options[] =
    {
@@ -445,6 +2883,66 @@ main (int    argc,
        N_("Display more information about processing and updating progress"),
        NULL},
 
+     { "reverse-index", 0, 0, G_OPTION_ARG_NONE, &reverse_index,
+       N_("Also write the list of MIME types handled by each desktop file"),
+       NULL},
+
+     { "max-depth", 0, 0, G_OPTION_ARG_INT, &max_depth,
+       N_("Do not look for desktop files in subdirectories more than DEPTH "
+          "levels deep"),
+       N_("DEPTH") },
+
+     { "max-memory", 0, 0, G_OPTION_ARG_CALLBACK,
+       (gpointer) parse_max_memory,
+       N_("Use temporary files to keep the memory used to store MIME types "
+          "under about SIZE bytes (K, M and G suffixes are accepted)"),
+       N_("SIZE") },
+
+     { "io-backend", 0, 0, G_OPTION_ARG_CALLBACK,
+       (gpointer) parse_io_backend,
+       N_("Read desktop files with BACKEND: sync (default), threads, "
+          "io_uring or auto"),
+       N_("BACKEND") },
+
+     { "background", 0, 0, G_OPTION_ARG_NONE, &background,
+       N_("Use idle I/O priority and low CPU priority, to not slow down "
+          "other processes"),
+       NULL},
+
+     { "drop-cache", 0, 0, G_OPTION_ARG_NONE, &drop_cache,
+       N_("Tell the system that the desktop files will not be needed again "
+          "once read"),
+       NULL},
+
+     { "sync", 0, 0, G_OPTION_ARG_CALLBACK, (gpointer) parse_sync,
+       N_("Flush cache files to disk: none (default), file (each cache "
+          "file) or batch (all cache files at once, before renaming them)"),
+       N_("POLICY") },
+
+     { "stats", 0, G_OPTION_FLAG_OPTIONAL_ARG, G_OPTION_ARG_CALLBACK,
+       (gpointer) parse_stats,
+       N_("Print the time spent in each phase and other statistics, as text "
+          "(default) or as JSON"),
+       N_("FORMAT") },
+
+     { "check", 0, 0, G_OPTION_ARG_NONE, &check,
+       N_("Do not update the databases, exit with status 1 if one of them "
+          "is out of date"),
+       NULL},
+
+     { "if-stale", 0, 0, G_OPTION_ARG_NONE, &if_stale,
+       N_("Only update the databases that are out of date"),
+       NULL},
+
+     { "root", 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &root_args,
+       N_("Look for the directories inside ROOT, as if it was the root "
+          "directory (can be used several times)"),
+       N_("ROOT") },
+
+     { "root-list", 0, 0, G_OPTION_ARG_FILENAME, &root_list,
+       N_("Read a list of root directories, one per line, from FILE"),
+       N_("FILE") },
+
      { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &desktop_dirs,
        NULL, N_("[DIRECTORY...]") },
      { NULL }
@@ -455,6 +2953,8 @@ main (int    argc,
   g_option_context_add_main_entries (context, options, NULL);
 
   desktop_dirs = NULL;
+  root_args = NULL;
+  root_list = NULL;
   error = NULL;
   g_option_context_parse (context, &argc, &argv, &error);
 
@@ -465,41 +2965,103 @@ main (int    argc,
     return 1;
   }
 
+  if (background)
+    set_background_priority ();
+
+  file_reader = dfu_file_reader_new (io_backend, &error);
+
+  if (error != NULL) {
+    g_printerr ("%s\n", error->message);
+    g_error_free (error);
+    return 1;
+  }
+
+  dfu_file_reader_set_drop_cache (file_reader, drop_cache);
+  if (background)
+    dfu_file_reader_set_max_workers (file_reader, BACKGROUND_MAX_WORKERS);
+
+  udd_verbose_print (_("Reading desktop files with the %s backend\n"),
+                     dfu_file_reader_backend_to_string (dfu_file_reader_get_backend (file_reader)));
+
   if (desktop_dirs == NULL || desktop_dirs[0] == NULL)
     desktop_dirs = get_default_search_path ();
 
   print_desktop_dirs (desktop_dirs);
 
-  found_processable_dir = FALSE;
-  for (i = 0; desktop_dirs[i] != NULL; i++)
+  roots = get_roots (root_args, root_list, &error);
+  if (error != NULL)
     {
-      error = NULL;
-      update_database (desktop_dirs[i], &error);
+      g_printerr ("%s\n", error->message);
+      g_error_free (error);
+      return 1;
+    }
 
-      if (error != NULL)
-        {
-          udd_verbose_print (_("Could not create cache file in \"%s\": %s\n"),
-                             desktop_dirs[i], error->message);
-          g_error_free (error);
-          error = NULL;
-        }
-      else
-        found_processable_dir = TRUE;
+  if (roots->len > 1)
+    parse_cache = g_hash_table_new_full (parsed_desktop_file_hash,
+                                         parsed_desktop_file_equal,
+                                         (GDestroyNotify) parsed_desktop_file_free,
+                                         NULL);
+
+  if (sync_policy == SYNC_BATCH)
+    pending_cache_files = g_ptr_array_new ();
+  written_stamps = g_ptr_array_new ();
+
+  for (i = 0; i < (int) roots->len; i++)
+    update_root (g_ptr_array_index (roots, i), desktop_dirs);
+
+  if (sync_policy == SYNC_BATCH)
+    {
+      commit_pending_cache_files ();
+      g_ptr_array_free (pending_cache_files, TRUE);
     }
+
+  update_nested_stamps ();
+  free_written_stamps ();
+
   g_option_context_free (context);
+  dfu_file_reader_free (file_reader);
+  if (parse_cache != NULL)
+    g_hash_table_destroy (parse_cache);
 
-  if (!found_processable_dir)
+  if (stats_format != STATS_NONE)
+    print_peak_rss ();
+
+  if (check)
+    return n_out_of_date_caches > 0 ? 1 : 0;
+
+  failed = FALSE;
+  for (i = 0; i < (int) roots->len; i++)
     {
+      Root *root = g_ptr_array_index (roots, i);
       char *directories;
+      int j;
+
+      if (root->n_updated_dirs > 0)
+        continue;
+
+      directories = NULL;
+      for (j = 0; desktop_dirs[j] != NULL; j++)
+        {
+          char *dir, *tmp;
+
+          dir = get_display_dir (root, desktop_dirs[j]);
+          if (directories == NULL)
+            directories = dir;
+          else
+            {
+              tmp = g_strjoin (", ", directories, dir, NULL);
+              g_free (directories);
+              g_free (dir);
+              directories = tmp;
+            }
+        }
 
-      directories = g_strjoinv (", ", (char **) desktop_dirs);
       udd_print (_("The databases in [%s] could not be updated.\n"),
                  directories);
 
       g_free (directories);
-
-      return 1;
+      failed = TRUE;
     }
 
-  return 0;
+  return failed ? 1 : 0;
 }
@@ -39,9 +39,14 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include <glib.h>
 #include <glib/gstdio.h>
 
+#include "arena.h"
 #include "keyfileutils.h"
 #include "mimeutils.h"
 #include "validate.h"
@@ -90,25 +95,60 @@ typedef enum {
   DESKTOP_REGEXP_LIST_TYPE
 } DesktopKeyType;
 
+/* What a line contains, found while looking for its end: most lines are
+ * printable ASCII, and their values do not need to be checked for control
+ * characters or for UTF-8 again. */
+#define LINE_HAS_NON_ASCII (1 << 0)
+#define LINE_HAS_CONTROL   (1 << 1)
+
 typedef struct _kf_keyvalue kf_keyvalue;
 
 struct _kf_keyvalue {
-  char *key;
-  char *value;
+  char  *key;
+  char  *value;
+  /* LINE_* flags of the line of the key */
+  guint  line_flags;
+};
+
+typedef struct _kf_group kf_group;
+
+/* The groups, and the keys of each group, are stored in arrays in the order
+ * of the file; keys and values point into the contents of the file. */
+struct _kf_group {
+  char        *name;
+  kf_keyvalue *keys;
+  guint        n_keys;
+  guint        n_allocated_keys;
 };
 
 typedef struct _kf_validator kf_validator;
 
 struct _kf_validator {
   const char  *filename;
+  GString     *output;
+  DfuValidatorMessageFunc message_func;
+  gpointer     message_data;
+
+  /* the contents of the file, and everything parsed from it, are allocated
+   * here */
+  DfuArena    *arena;
 
-  GString     *parse_buffer;
   gboolean     utf8_warning;
   gboolean     cr_error;
 
   char        *current_group;
-  GHashTable  *groups;
+  kf_group    *current_group_data;
+  kf_group    *groups;
+  guint        n_groups;
+  guint        n_allocated_groups;
+  /* index of each group in groups, plus one */
+  GHashTable  *group_indexes;
+  /* keys of the group being validated, and how many times each one is
+   * present */
   GHashTable  *current_keys;
+  GHashTable  *duplicated_keys;
+  /* LINE_* flags of the line of the key being validated */
+  guint        current_line_flags;
 
   gboolean     kde_reserved_warnings;
   gboolean     no_deprecated_warnings;
@@ -119,10 +159,10 @@ struct _kf_validator {
   char        *type_string;
 
   gboolean     show_in;
-  GList       *application_keys;
-  GList       *link_keys;
-  GList       *fsdevice_keys;
-  GList       *mimetype_keys;
+  GPtrArray   *application_keys;
+  GPtrArray   *link_keys;
+  GPtrArray   *fsdevice_keys;
+  GPtrArray   *mimetype_keys;
 
   GHashTable  *action_values;
   GHashTable  *action_groups;
@@ -269,13 +309,14 @@ static struct {
                                const char   *locale,
                                const char   *value);
 } validate_for_type[] = {
+  /* indexed by DesktopKeyType */
   { DESKTOP_STRING_TYPE,            validate_string_key            },
   { DESKTOP_LOCALESTRING_TYPE,      validate_localestring_key      },
   { DESKTOP_BOOLEAN_TYPE,           validate_boolean_key           },
   { DESKTOP_NUMERIC_TYPE,           validate_numeric_key           },
   { DESKTOP_STRING_LIST_TYPE,       validate_string_list_key       },
-  { DESKTOP_REGEXP_LIST_TYPE,       validate_regexp_list_key       },
-  { DESKTOP_LOCALESTRING_LIST_TYPE, validate_localestring_list_key }
+  { DESKTOP_LOCALESTRING_LIST_TYPE, validate_localestring_list_key },
+  { DESKTOP_REGEXP_LIST_TYPE,       validate_regexp_list_key       }
 };
 
 typedef struct {
@@ -366,6 +407,26 @@ static DesktopKeyDefinition registered_action_keys[] = {
   { DESKTOP_STRING_TYPE,            "Exec",               TRUE,  FALSE, FALSE, handle_exec_key }
 };
 
+/* Keys are looked up in a perfect hash table. The hash of a key only depends
+ * on its length and on its first, middle and last characters, multiplied by
+ * a factor chosen when the table is built so that no two registered keys
+ * share a slot: a key is found with one string comparison, and most unknown
+ * keys are rejected by their length, without any. */
+#define KEY_HASH_BITS 8
+#define KEY_HASH_SIZE (1 << KEY_HASH_BITS)
+
+typedef struct {
+  DesktopKeyDefinition *keys;
+  unsigned int          n_keys;
+  guint32               factor;
+  /* index of the key in each slot plus one, and length of this key */
+  guint8                slots[KEY_HASH_SIZE];
+  gsize                 lengths[KEY_HASH_SIZE];
+} DesktopKeyTable;
+
+static DesktopKeyTable desktop_key_table;
+static DesktopKeyTable action_key_table;
+
 /* This should be the same list as in xdg-specs/menu/menu-spec.xml */
 static const char *show_in_registered[] = {
     "GNOME", "KDE", "LXDE", "LXQt", "MATE", "Razor", "ROX", "TDE", "Unity", "XFCE", "EDE", "Cinnamon", "Pantheon", "Old"
@@ -538,6 +599,66 @@ static struct {
   { "Applications",           FALSE, FALSE, TRUE,  { NULL }, { NULL } }
 };
 
+/* The categories above are compiled, once, into a graph: each category name
+ * is given an identifier, its index in registered_categories (the first one
+ * for names registered twice), with the same kind of perfect hash table as
+ * the keys, and the categories it requires or suggests are turned into sets
+ * of identifiers. Checking a Categories value is then a matter of bit
+ * operations on the set of categories it contains. */
+#define CATEGORY_HASH_BITS 11
+#define CATEGORY_HASH_SIZE (1 << CATEGORY_HASH_BITS)
+#define CATEGORY_SET_WORDS ((G_N_ELEMENTS (registered_categories) + 63) / 64)
+
+typedef struct {
+  guint64 bits[CATEGORY_SET_WORDS];
+} CategorySet;
+
+typedef struct {
+  gsize       length;
+  /* main categories among the required ones: if one of them is present, this
+   * category is not counted as a main category */
+  CategorySet main_requires;
+  /* each set must be fully present for the requirement or the suggestion to
+   * be satisfied */
+  CategorySet requires[G_N_ELEMENTS (registered_categories[0].requires)];
+  CategorySet suggests[G_N_ELEMENTS (registered_categories[0].suggests)];
+} CategoryNode;
+
+static struct {
+  guint32      factor;
+  /* identifier of the category in each slot plus one */
+  guint8       slots[CATEGORY_HASH_SIZE];
+  CategoryNode nodes[G_N_ELEMENTS (registered_categories)];
+} category_graph;
+
+/* Messages are printed right away, unless they are collected in
+ * kf->output or given to kf->message_func */
+static void
+print_message (kf_validator      *kf,
+               DfuValidatorLevel  level,
+               const char        *kind,
+               char              *str)
+{
+  if (kf->output != NULL)
+    {
+      g_string_append (kf->output, kf->filename);
+      g_string_append (kf->output, kind);
+      g_string_append (kf->output, str);
+    }
+  else if (kf->message_func != NULL)
+    {
+      gsize len;
+
+      len = strlen (str);
+      if (len > 0 && str[len - 1] == '\n')
+        str[len - 1] = '\0';
+
+      kf->message_func (kf->filename, level, str, kf->message_data);
+    }
+  else
+    g_print ("%s%s%s", kf->filename, kind, str);
+}
+
 static void
 print_fatal (kf_validator *kf, const char *format, ...)
 {
@@ -552,7 +673,7 @@ print_fatal (kf_validator *kf, const char *format, ...)
   str = g_strdup_vprintf (format, args);
   va_end (args);
 
-  g_print ("%s: error: %s", kf->filename, str);
+  print_message (kf, DFU_VALIDATOR_ERROR, ": error: ", str);
 
   g_free (str);
 }
@@ -569,7 +690,8 @@ print_future_fatal (kf_validator *kf, const char *format, ...)
   str = g_strdup_vprintf (format, args);
   va_end (args);
 
-  g_print ("%s: error: (will be fatal in the future): %s", kf->filename, str);
+  print_message (kf, DFU_VALIDATOR_FUTURE_ERROR,
+                 ": error: (will be fatal in the future): ", str);
 
   g_free (str);
 }
@@ -586,7 +708,7 @@ print_warning (kf_validator *kf, const char *format, ...)
   str = g_strdup_vprintf (format, args);
   va_end (args);
 
-  g_print ("%s: warning: %s", kf->filename, str);
+  print_message (kf, DFU_VALIDATOR_WARNING, ": warning: ", str);
 
   g_free (str);
 }
@@ -606,7 +728,7 @@ print_hint (kf_validator *kf, const char *format, ...)
   str = g_strdup_vprintf (format, args);
   va_end (args);
 
-  g_print ("%s: hint: %s", kf->filename, str);
+  print_message (kf, DFU_VALIDATOR_HINT, ": hint: ", str);
 
   g_free (str);
 }
@@ -645,7 +767,8 @@ validate_string_key (kf_validator *kf,
 
   error = FALSE;
 
-  for (i = 0; value[i] != '\0'; i++) {
+  for (i = 0; (kf->current_line_flags & LINE_HAS_CONTROL) &&
+              value[i] != '\0'; i++) {
     if (g_ascii_iscntrl (value[i])) {
       error = TRUE;
       break;
@@ -684,7 +807,8 @@ validate_localestring_key (kf_validator *kf,
   else
     locale_key = g_strdup_printf ("%s", key);
 
-  if (!g_utf8_validate (value, -1, NULL)) {
+  if ((kf->current_line_flags & LINE_HAS_NON_ASCII) &&
+      !g_utf8_validate (value, -1, NULL)) {
     print_fatal (kf, "value \"%s\" for locale string key \"%s\" in group "
                      "\"%s\" contains invalid UTF-8 characters, locale string "
                      "values should be encoded in UTF-8\n",
@@ -784,7 +908,8 @@ validate_string_regexp_list_key (kf_validator *kf,
 
   error = FALSE;
 
-  for (i = 0; value[i] != '\0'; i++) {
+  for (i = 0; (kf->current_line_flags & LINE_HAS_CONTROL) &&
+              value[i] != '\0'; i++) {
     if (g_ascii_iscntrl (value[i])) {
       error = TRUE;
       break;
@@ -845,7 +970,8 @@ validate_localestring_list_key (kf_validator *kf,
     locale_key = g_strdup_printf ("%s", key);
 
 
-  if (!g_utf8_validate (value, -1, NULL)) {
+  if ((kf->current_line_flags & LINE_HAS_NON_ASCII) &&
+      !g_utf8_validate (value, -1, NULL)) {
     print_fatal (kf, "value \"%s\" for locale string list key \"%s\" in group "
                      "\"%s\" contains invalid UTF-8 characters, locale string "
                      "list values should be encoded in UTF-8\n",
@@ -1052,9 +1178,10 @@ handle_show_in_key (kf_validator *kf,
                     const char   *value)
 {
   gboolean       retval;
-  char         **show;
-  GHashTable    *hashtable;
-  int            i;
+  DfuListIter    iter;
+  DfuListSet     seen;
+  const char    *show;
+  gsize          len;
   unsigned int   j;
 
   retval = TRUE;
@@ -1067,43 +1194,37 @@ handle_show_in_key (kf_validator *kf,
   }
   kf->show_in = TRUE;
 
-  hashtable = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, NULL);
-  show = g_strsplit (value, ";", 0);
-
-  for (i = 0; show[i]; i++) {
-    /* since the value ends with a semicolon, we'll have an empty string
-     * at the end */
-    if (*show[i] == '\0' && show[i + 1] == NULL)
-      break;
+  dfu_list_set_init (&seen);
+  dfu_list_iter_init (&iter, value);
 
-    if (g_hash_table_lookup (hashtable, show[i])) {
+  while (dfu_list_iter_next (&iter, &show, &len)) {
+    if (!dfu_list_set_add (&seen, show, len)) {
       print_warning (kf, "value \"%s\" for key \"%s\" in group \"%s\" "
-                         "contains \"%s\" more than once\n",
-                         value, locale_key, kf->current_group, show[i]);
+                         "contains \"%.*s\" more than once\n",
+                         value, locale_key, kf->current_group,
+                         (int) len, show);
       continue;
     }
 
-    g_hash_table_insert (hashtable, show[i], show[i]);
-
-    if (!strncmp (show[i], "X-", 2))
+    if (!strncmp (show, "X-", 2))
       continue;
 
     for (j = 0; j < G_N_ELEMENTS (show_in_registered); j++) {
-      if (!strcmp (show[i], show_in_registered[j]))
+      if (!strncmp (show, show_in_registered[j], len) &&
+          show_in_registered[j][len] == '\0')
         break;
     }
 
     if (j == G_N_ELEMENTS (show_in_registered)) {
       print_fatal (kf, "value \"%s\" for key \"%s\" in group \"%s\" "
-                       "contains an unregistered value \"%s\"; values "
+                       "contains an unregistered value \"%.*s\"; values "
                        "extending the format should start with \"X-\"\n",
-                       value, locale_key, kf->current_group, show[i]);
+                       value, locale_key, kf->current_group, (int) len, show);
       retval = FALSE;
     }
   }
 
-  g_strfreev (show);
-  g_hash_table_destroy (hashtable);
+  dfu_list_set_clear (&seen);
 
   return retval;
 }
@@ -1398,9 +1519,10 @@ handle_mime_key (kf_validator *kf,
                  const char   *value)
 {
   gboolean       retval;
-  char         **types;
-  GHashTable    *hashtable;
-  int            i;
+  DfuListIter    iter;
+  DfuListSet     seen;
+  const char    *item;
+  gsize          len;
   char          *valid_error;
   MimeUtilsValidity valid;
 
@@ -1408,25 +1530,23 @@ handle_mime_key (kf_validator *kf,
 
   retval = TRUE;
 
-  hashtable = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, NULL);
-  types = g_strsplit (value, ";", 0);
+  dfu_list_set_init (&seen);
+  dfu_list_iter_init (&iter, value);
 
-  for (i = 0; types[i]; i++) {
-    /* since the value ends with a semicolon, we'll have an empty string
-     * at the end */
-    if (*types[i] == '\0' && types[i + 1] == NULL)
-      break;
+  while (dfu_list_iter_next (&iter, &item, &len)) {
+    char *type;
 
-    if (g_hash_table_lookup (hashtable, types[i])) {
+    if (!dfu_list_set_add (&seen, item, len)) {
       print_warning (kf, "value \"%s\" for key \"%s\" in group \"%s\" "
-                         "contains \"%s\" more than once\n",
-                         value, locale_key, kf->current_group, types[i]);
+                         "contains \"%.*s\" more than once\n",
+                         value, locale_key, kf->current_group,
+                         (int) len, item);
       continue;
     }
 
-    g_hash_table_insert (hashtable, types[i], types[i]);
+    type = dfu_arena_strndup (kf->arena, item, len);
 
-    valid = mu_mime_type_is_valid (types[i], &valid_error);
+    valid = mu_mime_type_is_valid (type, &valid_error);
     switch (valid) {
       case MU_VALID:
         break;
@@ -1435,7 +1555,7 @@ handle_mime_key (kf_validator *kf,
                            "contains value \"%s\" which is a MIME type that "
                            "should probably not be used: %s\n",
                            value, locale_key, kf->current_group,
-                           types[i], valid_error);
+                           type, valid_error);
 
         g_free (valid_error);
         break;
@@ -1444,7 +1564,7 @@ handle_mime_key (kf_validator *kf,
                                 "contains value \"%s\" which is an invalid "
                                 "MIME type: %s\n",
                                 value, locale_key, kf->current_group,
-                                types[i], valid_error);
+                                type, valid_error);
 
         retval = FALSE;
         g_free (valid_error);
@@ -1454,12 +1574,179 @@ handle_mime_key (kf_validator *kf,
     }
   }
 
-  g_strfreev (types);
-  g_hash_table_destroy (hashtable);
+  dfu_list_set_clear (&seen);
 
   return retval;
 }
 
+static guint
+key_hash (const char *key,
+          gsize       len,
+          guint32     factor,
+          guint       bits)
+{
+  guint32 hash;
+
+  hash = len;
+  hash = hash * 31 + (guchar) key[0];
+  hash = hash * 31 + (guchar) key[len / 2];
+  hash = hash * 31 + (guchar) key[len - 1];
+
+  return (guint32) (hash * factor) >> (32 - bits);
+}
+
+static int
+category_graph_lookup (const char *name,
+                       gsize       len)
+{
+  guint  slot;
+  guint8 index;
+
+  if (len == 0)
+    return -1;
+
+  slot = key_hash (name, len, category_graph.factor, CATEGORY_HASH_BITS);
+  index = category_graph.slots[slot];
+  if (index == 0 || category_graph.nodes[index - 1].length != len ||
+      memcmp (registered_categories[index - 1].name, name, len) != 0)
+    return -1;
+
+  return index - 1;
+}
+
+static inline void
+category_set_add (CategorySet *set,
+                  int          id)
+{
+  set->bits[id / 64] |= G_GUINT64_CONSTANT (1) << (id % 64);
+}
+
+static inline gboolean
+category_set_contains (const CategorySet *set,
+                       int                id)
+{
+  return (set->bits[id / 64] & (G_GUINT64_CONSTANT (1) << (id % 64))) != 0;
+}
+
+static inline gboolean
+category_set_intersects (const CategorySet *a,
+                         const CategorySet *b)
+{
+  unsigned int i;
+
+  for (i = 0; i < CATEGORY_SET_WORDS; i++) {
+    if (a->bits[i] & b->bits[i])
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+static inline gboolean
+category_set_includes (const CategorySet *set,
+                       const CategorySet *subset)
+{
+  unsigned int i;
+
+  for (i = 0; i < CATEGORY_SET_WORDS; i++) {
+    if ((set->bits[i] & subset->bits[i]) != subset->bits[i])
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+category_graph_try_factor (guint32 factor)
+{
+  unsigned int i;
+
+  memset (category_graph.slots, 0, sizeof (category_graph.slots));
+
+  for (i = 0; i < G_N_ELEMENTS (registered_categories); i++) {
+    const char *name;
+    guint       slot;
+    guint8      index;
+
+    name = registered_categories[i].name;
+    slot = key_hash (name, category_graph.nodes[i].length, factor,
+                     CATEGORY_HASH_BITS);
+    index = category_graph.slots[slot];
+
+    if (index == 0)
+      category_graph.slots[slot] = i + 1;
+    /* a name registered twice keeps the identifier of its first entry */
+    else if (strcmp (registered_categories[index - 1].name, name) != 0)
+      return FALSE;
+  }
+
+  category_graph.factor = factor;
+
+  return TRUE;
+}
+
+/* Adds to set the categories of a ";"-separated list, or only the main ones */
+static void
+category_set_add_list (CategorySet *set,
+                       const char  *list,
+                       gboolean     main_only)
+{
+  const char *end;
+
+  do {
+    int id;
+
+    end = strchr (list, ';');
+    if (end == NULL)
+      end = list + strlen (list);
+
+    id = category_graph_lookup (list, end - list);
+    g_assert (id >= 0);
+
+    if (!main_only || registered_categories[id].main)
+      category_set_add (set, id);
+
+    list = end + 1;
+  } while (*end != '\0');
+}
+
+static void
+category_graph_init (void)
+{
+  guint32      factor;
+  unsigned int i;
+  unsigned int k;
+
+  g_assert (G_N_ELEMENTS (registered_categories) < 256);
+
+  for (i = 0; i < G_N_ELEMENTS (registered_categories); i++)
+    category_graph.nodes[i].length = strlen (registered_categories[i].name);
+
+  /* odd factors around 2^32 / golden ratio, which mix the bits well */
+  factor = 0x9e3779b1;
+  for (i = 0; i < 1 << 20; i++, factor += 2) {
+    if (category_graph_try_factor (factor))
+      break;
+  }
+
+  g_assert (i < 1 << 20);
+
+  for (i = 0; i < G_N_ELEMENTS (registered_categories); i++) {
+    CategoryNode *node = &category_graph.nodes[i];
+
+    for (k = 0; registered_categories[i].requires[k] != NULL; k++) {
+      category_set_add_list (&node->requires[k],
+                             registered_categories[i].requires[k], FALSE);
+      category_set_add_list (&node->main_requires,
+                             registered_categories[i].requires[k], TRUE);
+    }
+
+    for (k = 0; registered_categories[i].suggests[k] != NULL; k++)
+      category_set_add_list (&node->suggests[k],
+                             registered_categories[i].suggests[k], FALSE);
+  }
+}
+
 /* + FIXME: are there restrictions on how a category should be named?
  * + Categories in which the entry should be shown in a menu (for possible
  *   values see the Desktop Menu Specification).
@@ -1496,10 +1783,12 @@ handle_categories_key (kf_validator *kf,
                        const char   *value)
 {
   gboolean       retval;
-  char         **categories;
-  GHashTable    *hashtable;
-  int            i;
-  unsigned int   j;
+  DfuListIter    iter;
+  DfuListSet     unregistered;
+  CategorySet    present;
+  const char    *item;
+  gsize          len;
+  int            id;
   int            main_categories_nb;
 
   handle_key_for_application (kf, locale_key, value);
@@ -1510,166 +1799,113 @@ handle_categories_key (kf_validator *kf,
   if (value[0] == '\0')
     return retval;
 
-  hashtable = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, NULL);
-  categories = g_strsplit (value, ";", 0);
-
-  /* this is a two-pass check: we first put the categories in a hash table so
-   * that they are easy-to-find, and we then do many checks */
+  /* this is a two-pass check: we first compute the set of categories that
+   * are present, and we then do many checks */
 
   /* first pass */
-  for (i = 0; categories[i]; i++) {
-    /* since the value ends with a semicolon, we'll have an empty string
-     * at the end */
-    if (*categories[i] == '\0' && categories[i + 1] == NULL)
-      break;
+  memset (&present, 0, sizeof (present));
+  dfu_list_set_init (&unregistered);
+  dfu_list_iter_init (&iter, value);
 
-    if (g_hash_table_lookup (hashtable, categories[i])) {
-      print_warning (kf, "value \"%s\" for key \"%s\" in group \"%s\" "
-                         "contains \"%s\" more than once\n",
-                         value, locale_key, kf->current_group, categories[i]);
-      continue;
-    }
+  while (dfu_list_iter_next (&iter, &item, &len)) {
+    gboolean duplicate;
+
+    id = category_graph_lookup (item, len);
+
+    if (id >= 0) {
+      duplicate = category_set_contains (&present, id);
+      category_set_add (&present, id);
+    } else
+      duplicate = !dfu_list_set_add (&unregistered, item, len);
 
-    g_hash_table_insert (hashtable, categories[i], categories[i]);
+    if (duplicate)
+      print_warning (kf, "value \"%s\" for key \"%s\" in group \"%s\" "
+                         "contains \"%.*s\" more than once\n",
+                         value, locale_key, kf->current_group,
+                         (int) len, item);
   }
 
+  dfu_list_set_clear (&unregistered);
+
   /* second pass */
   main_categories_nb = 0;
 
-  for (i = 0; categories[i]; i++) {
-    unsigned int k;
+  dfu_list_iter_init (&iter, value);
 
-    /* since the value ends with a semicolon, we'll have an empty string
-     * at the end */
-    if (*categories[i] == '\0' && categories[i + 1] == NULL)
-      break;
+  while (dfu_list_iter_next (&iter, &item, &len)) {
+    CategoryNode *node;
+    unsigned int  k;
 
-    if (!strncmp (categories[i], "X-", 2))
+    if (!strncmp (item, "X-", 2))
       continue;
 
-    for (j = 0; j < G_N_ELEMENTS (registered_categories); j++) {
-      if (!strcmp (categories[i], registered_categories[j].name))
-        break;
-    }
+    id = category_graph_lookup (item, len);
 
-    if (j == G_N_ELEMENTS (registered_categories)) {
+    if (id < 0) {
       print_fatal (kf, "value \"%s\" for key \"%s\" in group \"%s\" "
-                       "contains an unregistered value \"%s\"; values "
+                       "contains an unregistered value \"%.*s\"; values "
                        "extending the format should start with \"X-\"\n",
-                       value, locale_key, kf->current_group, categories[i]);
+                       value, locale_key, kf->current_group, (int) len, item);
       retval = FALSE;
       continue;
     }
 
-    if (registered_categories[j].main) {
+    node = &category_graph.nodes[id];
+
+    if (registered_categories[id].main) {
       /* only count it as a main category if none of the required categories
        * for this one is also a main category (and is present) */
-      gboolean required_main_category_present = FALSE;
-
-      for (k = 0; registered_categories[j].requires[k] != NULL; k++) {
-        char **required_categories;
-        int    l;
-
-        required_categories = g_strsplit (registered_categories[j].requires[k],
-                                          ";", 0);
-
-        for (l = 0; required_categories[l]; l++) {
-          unsigned int m;
-
-          if (!g_hash_table_lookup (hashtable, required_categories[l]))
-            continue;
-
-          for (m = 0; m < G_N_ELEMENTS (registered_categories); m++) {
-            if (strcmp (required_categories[l],
-                        registered_categories[m].name) != 0)
-              continue;
-
-            if (registered_categories[m].main)
-              required_main_category_present = TRUE;
-
-            break;
-          }
-
-          if (required_main_category_present)
-            break;
-        }
-
-        if (required_main_category_present) {
-          g_strfreev (required_categories);
-          break;
-        }
-
-        g_strfreev (required_categories);
-      }
-
-      if (!required_main_category_present)
+      if (!category_set_intersects (&node->main_requires, &present))
         main_categories_nb++;
-    }
-
-    if (registered_categories[j].main && main_categories_nb > 1)
-      print_hint (kf, "value \"%s\" for key \"%s\" in group \"%s\" "
-                      "contains more than one main category; application "
-                      "might appear more than once in the application menu\n",
-                      value, locale_key, kf->current_group);
 
+      if (main_categories_nb > 1)
+        print_hint (kf, "value \"%s\" for key \"%s\" in group \"%s\" "
+                        "contains more than one main category; application "
+                        "might appear more than once in the application "
+                        "menu\n",
+                        value, locale_key, kf->current_group);
+    }
 
-    if (registered_categories[j].deprecated) {
+    if (registered_categories[id].deprecated) {
       if (!kf->no_deprecated_warnings)
         print_warning (kf, "value \"%s\" for key \"%s\" in group \"%s\" "
-                           "contains a deprecated value \"%s\"\n",
+                           "contains a deprecated value \"%.*s\"\n",
                             value, locale_key, kf->current_group,
-                            categories[i]);
+                            (int) len, item);
     }
 
-    if (registered_categories[j].require_only_show_in) {
+    if (registered_categories[id].require_only_show_in) {
       if (!g_hash_table_lookup (kf->current_keys, "OnlyShowIn")) {
-        print_fatal (kf, "value item \"%s\" in key \"%s\" in group \"%s\" "
+        print_fatal (kf, "value item \"%.*s\" in key \"%s\" in group \"%s\" "
                          "is a reserved category, so a \"OnlyShowIn\" key "
                          "must be included\n",
-                         categories[i], locale_key, kf->current_group);
+                         (int) len, item, locale_key, kf->current_group);
         retval = FALSE;
       }
     }
 
-    /* required categories */
-
-    for (k = 0; registered_categories[j].requires[k] != NULL; k++) {
-      char **required_categories;
-      int    l;
+    /* required categories: one of the sets must be fully present */
 
-      required_categories = g_strsplit (registered_categories[j].requires[k],
-                                        ";", 0);
-
-      for (l = 0; required_categories[l]; l++) {
-        if (!g_hash_table_lookup (hashtable, required_categories[l]))
-          break;
-      }
-
-      /* we've reached the end of a list of required categories, so
-       * the condition is satisfied */
-      if (required_categories[l] == NULL) {
-        g_strfreev (required_categories);
+    for (k = 0; registered_categories[id].requires[k] != NULL; k++) {
+      if (category_set_includes (&present, &node->requires[k]))
         break;
-      }
-
-      g_strfreev (required_categories);
     }
 
     /* we've reached the end of a non-empty set of required categories; this
      * means none of the possible required category (or list of required
      * categories) was found */
-    if (k != 0 && registered_categories[j].requires[k] == NULL) {
+    if (k != 0 && registered_categories[id].requires[k] == NULL) {
       GString *output_required;
 
-      output_required = g_string_new (registered_categories[j].requires[0]);
-      for (k = 1; registered_categories[j].requires[k] != NULL; k++)
+      output_required = g_string_new (registered_categories[id].requires[0]);
+      for (k = 1; registered_categories[id].requires[k] != NULL; k++)
         g_string_append_printf (output_required, ", or %s",
-                                registered_categories[j].requires[k]);
+                                registered_categories[id].requires[k]);
 
-      print_future_fatal (kf, "value item \"%s\" in key \"%s\" in group \"%s\" "
-                              "requires another category to be present among "
-                              "the following categories: %s\n",
-                              categories[i], locale_key, kf->current_group,
+      print_future_fatal (kf, "value item \"%.*s\" in key \"%s\" in group "
+                              "\"%s\" requires another category to be present "
+                              "among the following categories: %s\n",
+                              (int) len, item, locale_key, kf->current_group,
                               output_required->str);
 
       g_string_free (output_required, TRUE);
@@ -1678,43 +1914,26 @@ handle_categories_key (kf_validator *kf,
 
     /* suggested categories */
 
-    for (k = 0; registered_categories[j].suggests[k] != NULL; k++) {
-      char **suggested_categories;
-      int    l;
-
-      suggested_categories = g_strsplit (registered_categories[j].suggests[k],
-                                         ";", 0);
-
-      for (l = 0; suggested_categories[l]; l++) {
-        if (!g_hash_table_lookup (hashtable, suggested_categories[l]))
-          break;
-      }
-
-      /* we've reached the end of a list of suggested categories, so
-       * the condition is satisfied */
-      if (suggested_categories[l] == NULL) {
-        g_strfreev (suggested_categories);
+    for (k = 0; registered_categories[id].suggests[k] != NULL; k++) {
+      if (category_set_includes (&present, &node->suggests[k]))
         break;
-      }
-
-      g_strfreev (suggested_categories);
     }
 
     /* we've reached the end of a non-empty set of suggested categories; this
      * means none of the possible suggested category (or list of suggested
      * categories) was found */
-    if (k != 0 && registered_categories[j].suggests[k] == NULL) {
+    if (k != 0 && registered_categories[id].suggests[k] == NULL) {
       GString *output_suggested;
 
-      output_suggested = g_string_new (registered_categories[j].suggests[0]);
-      for (k = 1; registered_categories[j].suggests[k] != NULL; k++)
+      output_suggested = g_string_new (registered_categories[id].suggests[0]);
+      for (k = 1; registered_categories[id].suggests[k] != NULL; k++)
         g_string_append_printf (output_suggested, ", or %s",
-                                registered_categories[j].suggests[k]);
+                                registered_categories[id].suggests[k]);
 
-      print_hint (kf, "value item \"%s\" in key \"%s\" in group \"%s\" "
+      print_hint (kf, "value item \"%.*s\" in key \"%s\" in group \"%s\" "
                       "can be extended with another category among the "
                       "following categories: %s\n",
-                      categories[i], locale_key, kf->current_group,
+                      (int) len, item, locale_key, kf->current_group,
                       output_suggested->str);
 
       g_string_free (output_suggested, TRUE);
@@ -1722,9 +1941,6 @@ handle_categories_key (kf_validator *kf,
 
   }
 
-  g_strfreev (categories);
-  g_hash_table_destroy (hashtable);
-
   g_assert (main_categories_nb >= 0);
 
   if (main_categories_nb == 0)
@@ -1748,53 +1964,49 @@ handle_actions_key (kf_validator *kf,
                     const char   *locale_key,
                     const char   *value)
 {
-  char **actions;
-  char  *action;
-  int    i;
-  gboolean retval;
+  DfuListIter  iter;
+  const char  *item;
+  gsize        len;
+  char        *action;
+  gboolean     retval;
 
   handle_key_for_application (kf, locale_key, value);
 
   retval = TRUE;
-  actions = g_strsplit (value, ";", 0);
-
-  for (i = 0; actions[i]; i++) {
-    /* since the value ends with a semicolon, we'll have an empty string
-     * at the end */
-    if (*actions[i] == '\0') {
-      if (actions[i + 1] != NULL) {
-        print_fatal (kf, "value \"%s\" for key \"%s\" in group \"%s\" "
-                         "contains an empty action\n",
-                         value, locale_key, kf->current_group);
-        retval = FALSE;
-        break;
-      }
+  dfu_list_iter_init (&iter, value);
 
-      continue;
+  while (dfu_list_iter_next (&iter, &item, &len)) {
+    /* there is no empty item after the last semicolon, so this one is
+     * between two semicolons */
+    if (len == 0) {
+      print_fatal (kf, "value \"%s\" for key \"%s\" in group \"%s\" "
+                       "contains an empty action\n",
+                       value, locale_key, kf->current_group);
+      retval = FALSE;
+      break;
     }
 
-    if (g_hash_table_lookup (kf->action_values, actions[i])) {
+    action = dfu_arena_strndup (kf->arena, item, len);
+
+    if (g_hash_table_lookup (kf->action_values, action)) {
       print_warning (kf, "value \"%s\" for key \"%s\" in group \"%s\" "
                          "contains action \"%s\" more than once\n",
-                         value, locale_key, kf->current_group, actions[i]);
+                         value, locale_key, kf->current_group, action);
       continue;
     }
 
-    if (!key_is_valid (actions[i], strlen (actions[i]))) {
+    if (!key_is_valid (action, len)) {
       print_fatal (kf, "value \"%s\" for key \"%s\" in group \"%s\" "
                        "contains invalid action identifier \"%s\", only "
                        "alphanumeric characters and '-' are allowed\n",
-                       value, locale_key, kf->current_group, actions[i]);
+                       value, locale_key, kf->current_group, action);
       retval = FALSE;
       break;
     }
 
-    action = g_strdup (actions[i]);
     g_hash_table_insert (kf->action_values, action, action);
   }
 
-  g_strfreev (actions);
-
   return retval;
 }
 
@@ -2111,8 +2323,7 @@ handle_key_for_application (kf_validator *kf,
                             const char   *locale_key,
                             const char   *value)
 {
-  kf->application_keys = g_list_append (kf->application_keys,
-                                        g_strdup (locale_key));
+  g_ptr_array_add (kf->application_keys, (char *) locale_key);
   return TRUE;
 }
 
@@ -2121,8 +2332,7 @@ handle_key_for_link (kf_validator *kf,
                      const char   *locale_key,
                      const char   *value)
 {
-  kf->link_keys = g_list_append (kf->link_keys,
-                                 g_strdup (locale_key));
+  g_ptr_array_add (kf->link_keys, (char *) locale_key);
   return TRUE;
 }
 
@@ -2131,8 +2341,7 @@ handle_key_for_fsdevice (kf_validator *kf,
                          const char   *locale_key,
                          const char   *value)
 {
-  kf->fsdevice_keys = g_list_append (kf->fsdevice_keys,
-                                     g_strdup (locale_key));
+  g_ptr_array_add (kf->fsdevice_keys, (char *) locale_key);
   return TRUE;
 }
 
@@ -2141,8 +2350,7 @@ handle_key_for_mimetype (kf_validator *kf,
                          const char   *locale_key,
                          const char   *value)
 {
-  kf->mimetype_keys = g_list_append (kf->mimetype_keys,
-                                     g_strdup (locale_key));
+  g_ptr_array_add (kf->mimetype_keys, (char *) locale_key);
   return TRUE;
 }
 
@@ -2153,7 +2361,8 @@ handle_key_for_mimetype (kf_validator *kf,
  *   Checked.
  */
 static gboolean
-key_extract_locale (const char  *key,
+key_extract_locale (DfuArena    *arena,
+                    const char  *key,
                     char       **real_key,
                     char       **locale)
 {
@@ -2179,7 +2388,7 @@ key_extract_locale (const char  *key,
 
   if (!start_locale) {
     if (real_key)
-      *real_key = g_strdup (key);
+      *real_key = dfu_arena_strdup (arena, key);
     if (locale)
       *locale = NULL;
 
@@ -2198,13 +2407,100 @@ key_extract_locale (const char  *key,
   }
 
   if (real_key)
-    *real_key = g_strndup (key, strlen (key) - len);
+    *real_key = dfu_arena_strndup (arena, key, strlen (key) - len);
   if (locale)
-    *locale = g_strndup (start_locale + 1, len - 2);
+    *locale = dfu_arena_strndup (arena, start_locale + 1, len - 2);
+
+  return TRUE;
+}
+
+static gboolean
+key_table_try_factor (DesktopKeyTable *table,
+                      guint32          factor)
+{
+  unsigned int i;
+
+  memset (table->slots, 0, sizeof (table->slots));
+
+  for (i = 0; i < table->n_keys; i++) {
+    gsize len;
+    guint slot;
+
+    len = strlen (table->keys[i].name);
+    slot = key_hash (table->keys[i].name, len, factor, KEY_HASH_BITS);
+    if (table->slots[slot] != 0)
+      return FALSE;
+
+    table->slots[slot] = i + 1;
+    table->lengths[slot] = len;
+  }
+
+  table->factor = factor;
 
   return TRUE;
 }
 
+static void
+key_table_init (DesktopKeyTable      *table,
+                DesktopKeyDefinition *keys,
+                unsigned int          n_keys)
+{
+  guint32 factor;
+  int     i;
+
+  g_assert (n_keys < 256);
+
+  table->keys = keys;
+  table->n_keys = n_keys;
+
+  /* odd factors around 2^32 / golden ratio, which mix the bits well */
+  factor = 0x9e3779b1;
+  for (i = 0; i < 1 << 20; i++, factor += 2) {
+    if (key_table_try_factor (table, factor))
+      return;
+  }
+
+  g_assert_not_reached ();
+}
+
+static gpointer
+init_lookup_tables (gpointer data)
+{
+  unsigned int i;
+
+  for (i = 0; i < G_N_ELEMENTS (validate_for_type); i++)
+    g_assert (validate_for_type[i].type == i);
+
+  key_table_init (&desktop_key_table, registered_desktop_keys,
+                  G_N_ELEMENTS (registered_desktop_keys));
+  key_table_init (&action_key_table, registered_action_keys,
+                  G_N_ELEMENTS (registered_action_keys));
+  category_graph_init ();
+
+  return NULL;
+}
+
+static DesktopKeyDefinition *
+key_table_lookup (DesktopKeyTable *table,
+                  const char      *key)
+{
+  gsize  len;
+  guint  slot;
+  guint8 index;
+
+  len = strlen (key);
+  if (len == 0)
+    return NULL;
+
+  slot = key_hash (key, len, table->factor, KEY_HASH_BITS);
+  index = table->slots[slot];
+  if (index == 0 || table->lengths[slot] != len ||
+      memcmp (table->keys[index - 1].name, key, len) != 0)
+    return NULL;
+
+  return &table->keys[index - 1];
+}
+
 /* + All keys extending the format should start with "X-".
  *   Checked.
  */
@@ -2214,60 +2510,46 @@ validate_known_key (kf_validator         *kf,
                     const char           *key,
                     const char           *locale,
                     const char           *value,
-                    DesktopKeyDefinition *keys,
-                    unsigned int          n_keys)
+                    DesktopKeyTable      *table)
 {
-  unsigned int i;
-  unsigned int j;
+  DesktopKeyDefinition *definition;
 
   if (!strncmp (key, "X-", 2))
     return TRUE;
 
-  for (i = 0; i < n_keys; i++) {
-    if (strcmp (key, keys[i].name))
-      continue;
+  definition = key_table_lookup (table, key);
 
-    if (keys[i].type != DESKTOP_LOCALESTRING_TYPE &&
-        keys[i].type != DESKTOP_LOCALESTRING_LIST_TYPE &&
-        locale != NULL) {
-      print_fatal (kf, "file contains key \"%s\" in group \"%s\", "
-                       "but \"%s\" is not defined as a locale string\n",
-                       locale_key, kf->current_group, key);
-      return FALSE;
-    }
+  if (!definition) {
+    print_fatal (kf, "file contains key \"%s\" in group \"%s\", but "
+                     "keys extending the format should start with "
+                     "\"X-\"\n", key, kf->current_group);
+    return FALSE;
+  }
 
-    for (j = 0; j < G_N_ELEMENTS (validate_for_type); j++) {
-      if (validate_for_type[j].type == keys[i].type)
-        break;
-    }
+  if (definition->type != DESKTOP_LOCALESTRING_TYPE &&
+      definition->type != DESKTOP_LOCALESTRING_LIST_TYPE &&
+      locale != NULL) {
+    print_fatal (kf, "file contains key \"%s\" in group \"%s\", "
+                     "but \"%s\" is not defined as a locale string\n",
+                     locale_key, kf->current_group, key);
+    return FALSE;
+  }
 
-    g_assert (j != G_N_ELEMENTS (validate_for_type));
+  if (!kf->no_deprecated_warnings && definition->deprecated)
+    print_warning (kf, "key \"%s\" in group \"%s\" is deprecated\n",
+                       locale_key, kf->current_group);
 
-    if (!kf->no_deprecated_warnings && keys[i].deprecated)
-      print_warning (kf, "key \"%s\" in group \"%s\" is deprecated\n",
-                         locale_key, kf->current_group);
+  if (definition->kde_reserved && kf->kde_reserved_warnings)
+    print_warning (kf, "key \"%s\" in group \"%s\" is a reserved key for "
+                       "KDE\n",
+                       locale_key, kf->current_group);
 
-    if (keys[i].kde_reserved && kf->kde_reserved_warnings)
-      print_warning (kf, "key \"%s\" in group \"%s\" is a reserved key for "
-                         "KDE\n",
-                         locale_key, kf->current_group);
+  if (!validate_for_type[definition->type].validate (kf, key, locale, value))
+    return FALSE;
 
-    if (!validate_for_type[j].validate (kf, key, locale, value))
+  if (definition->handle_and_validate != NULL) {
+    if (!definition->handle_and_validate (kf, locale_key, value))
       return FALSE;
-
-    if (keys[i].handle_and_validate != NULL) {
-      if (!keys[i].handle_and_validate (kf, locale_key, value))
-        return FALSE;
-    }
-
-    break;
-  }
-
-  if (i == n_keys) {
-    print_fatal (kf, "file contains key \"%s\" in group \"%s\", but "
-                     "keys extending the format should start with "
-                     "\"X-\"\n", key, kf->current_group);
-    return FALSE;
   }
 
   return TRUE;
@@ -2281,8 +2563,7 @@ validate_desktop_key (kf_validator *kf,
                       const char   *value)
 {
   return validate_known_key (kf, locale_key, key, locale, value,
-                             registered_desktop_keys,
-                             G_N_ELEMENTS (registered_desktop_keys));
+                             &desktop_key_table);
 }
 
 static gboolean
@@ -2293,8 +2574,48 @@ validate_action_key (kf_validator *kf,
                      const char   *value)
 {
   return validate_known_key (kf, locale_key, key, locale, value,
-                             registered_action_keys,
-                             G_N_ELEMENTS (registered_action_keys));
+                             &action_key_table);
+}
+
+static kf_group *
+lookup_group (kf_validator *kf,
+              const char   *name)
+{
+  guint index;
+
+  index = GPOINTER_TO_UINT (g_hash_table_lookup (kf->group_indexes, name));
+  if (index == 0)
+    return NULL;
+
+  return &kf->groups[index - 1];
+}
+
+static kf_group *
+add_group (kf_validator *kf,
+           char         *name)
+{
+  kf_group *group;
+
+  if (kf->n_groups == kf->n_allocated_groups) {
+    guint n_allocated;
+
+    n_allocated = MAX (8, 2 * kf->n_allocated_groups);
+    kf->groups = dfu_arena_realloc (kf->arena, kf->groups,
+                                    kf->n_allocated_groups * sizeof (kf_group),
+                                    n_allocated * sizeof (kf_group));
+    kf->n_allocated_groups = n_allocated;
+  }
+
+  group = &kf->groups[kf->n_groups++];
+  group->name             = name;
+  group->keys             = NULL;
+  group->n_keys           = 0;
+  group->n_allocated_keys = 0;
+
+  g_hash_table_insert (kf->group_indexes, name,
+                       GUINT_TO_POINTER (kf->n_groups));
+
+  return group;
 }
 
 /* + Multiple keys in the same group may not have the same name.
@@ -2306,11 +2627,10 @@ validate_keys_for_current_group (kf_validator *kf)
   gboolean     desktop_group;
   gboolean     action_group;
   gboolean     retval;
-  GHashTable  *duplicated_keys_hash;
   char        *key;
   char        *locale;
-  GSList      *keys;
-  GSList      *sl;
+  kf_keyvalue *keyvalue;
+  guint        i;
   gpointer     hashvalue;
 
   retval = TRUE;
@@ -2320,45 +2640,31 @@ validate_keys_for_current_group (kf_validator *kf)
   action_group = (!strncmp (kf->current_group, GROUP_DESKTOP_ACTION,
                             strlen (GROUP_DESKTOP_ACTION)));
 
-  keys = g_slist_copy (g_hash_table_lookup (kf->groups, kf->current_group));
-  /* keys were prepended, so reverse the list (that's why we use a
-   * g_slist_copy() */
-  keys = g_slist_reverse (keys);
-
-  kf->current_keys = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                            NULL, NULL);
-  duplicated_keys_hash = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                                NULL, NULL);
-
   /* we need two passes: some checks are looking if another key exists in the
    * group */
-  for (sl = keys; sl != NULL; sl = sl->next) {
-    kf_keyvalue *keyvalue;
-
-    keyvalue = (kf_keyvalue *) sl->data;
+  for (i = 0; i < kf->current_group_data->n_keys; i++) {
+    keyvalue = &kf->current_group_data->keys[i];
     g_hash_table_insert (kf->current_keys, keyvalue->key, keyvalue);
 
     /* we could display the error about duplicate keys here, but it's better
      * to display it with the first occurence of this key */
-    hashvalue = g_hash_table_lookup (duplicated_keys_hash, keyvalue->key);
+    hashvalue = g_hash_table_lookup (kf->duplicated_keys, keyvalue->key);
     if (!hashvalue)
-      g_hash_table_insert (duplicated_keys_hash, keyvalue->key,
+      g_hash_table_insert (kf->duplicated_keys, keyvalue->key,
                            GINT_TO_POINTER (1));
     else {
-      g_hash_table_replace (duplicated_keys_hash, keyvalue->key,
+      g_hash_table_replace (kf->duplicated_keys, keyvalue->key,
                             GINT_TO_POINTER (GPOINTER_TO_INT (hashvalue) + 1));
     }
   }
 
-  for (sl = keys; sl != NULL; sl = sl->next) {
-    kf_keyvalue *keyvalue;
+  for (i = 0; i < kf->current_group_data->n_keys; i++) {
     gboolean     skip_desktop_check;
 
-    keyvalue = (kf_keyvalue *) sl->data;
-
+    keyvalue = &kf->current_group_data->keys[i];
     skip_desktop_check = FALSE;
 
-    if (!key_extract_locale (keyvalue->key, &key, &locale)) {
+    if (!key_extract_locale (kf->arena, keyvalue->key, &key, &locale)) {
         print_fatal (kf, "file contains key \"%s\" in group \"%s\", but "
                          "key names must contain only the characters "
                          "A-Za-z0-9- (they may have a \"[LOCALE]\" postfix)\n",
@@ -2366,19 +2672,21 @@ validate_keys_for_current_group (kf_validator *kf)
         retval = FALSE;
         skip_desktop_check = TRUE;
 
-        key = g_strdup (keyvalue->key);
+        key = keyvalue->key;
     }
 
     g_assert (key != NULL);
 
-    hashvalue = g_hash_table_lookup (duplicated_keys_hash, keyvalue->key);
+    hashvalue = g_hash_table_lookup (kf->duplicated_keys, keyvalue->key);
     if (GPOINTER_TO_INT (hashvalue) > 1) {
-      g_hash_table_remove (duplicated_keys_hash, keyvalue->key);
+      g_hash_table_remove (kf->duplicated_keys, keyvalue->key);
       print_fatal (kf, "file contains multiple keys named \"%s\" in "
                        "group \"%s\"\n", keyvalue->key, kf->current_group);
       retval = FALSE;
     }
 
+    kf->current_line_flags = keyvalue->line_flags;
+
     if (desktop_group && !skip_desktop_check) {
       if (!validate_desktop_key (kf, keyvalue->key,
                                  key, locale, keyvalue->value))
@@ -2388,17 +2696,10 @@ validate_keys_for_current_group (kf_validator *kf)
                                 key, locale, keyvalue->value))
         retval = FALSE;
     }
-
-    g_free (key);
-    key = NULL;
-    g_free (locale);
-    locale = NULL;
   }
 
-  g_slist_free (keys);
-  g_hash_table_destroy (duplicated_keys_hash);
-  g_hash_table_destroy (kf->current_keys);
-  kf->current_keys = NULL;
+  g_hash_table_remove_all (kf->duplicated_keys);
+  g_hash_table_remove_all (kf->current_keys);
   /* Clear ShowIn flag, so that different groups can each have a OnlyShowIn /
    * NotShowIn key */
   kf->show_in = FALSE;
@@ -2473,19 +2774,19 @@ validate_group_name (kf_validator *kf,
                        "group with no action name\n", group);
       return FALSE;
     } else {
-      char *action;
+      const char *action;
 
-      action = g_strdup (group + strlen (GROUP_DESKTOP_ACTION));
+      action = group + strlen (GROUP_DESKTOP_ACTION);
 
       if (!key_is_valid (action, strlen (action))) {
         print_fatal (kf, "file contains group \"%s\", which has an invalid "
                          "action identifier, only alphanumeric characters and "
                          "'-' are allowed\n", group);
-        g_free (action);
         return FALSE;
       }
 
-      g_hash_table_insert (kf->action_groups, action, action);
+      g_hash_table_insert (kf->action_groups,
+                           (char *) action, (char *) action);
 
       return TRUE;
     }
@@ -2504,21 +2805,16 @@ validate_required_keys (kf_validator         *kf,
 {
   gboolean      retval;
   unsigned int  i;
-  GSList       *sl;
-  GSList       *keys;
+  kf_group     *group;
   GHashTable   *hashtable;
 
   retval = TRUE;
 
   hashtable = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, NULL);
-  keys = g_hash_table_lookup (kf->groups, group_name);
+  group = lookup_group (kf, group_name);
 
-  for (sl = keys; sl != NULL; sl = sl->next) {
-    kf_keyvalue *keyvalue;
-
-    keyvalue = (kf_keyvalue *) sl->data;
-    g_hash_table_insert (hashtable, keyvalue->key, keyvalue->key);
-  }
+  for (i = 0; group && i < group->n_keys; i++)
+    g_hash_table_insert (hashtable, group->keys[i].key, group->keys[i].key);
 
   for (i = 0; i < n_keys; i++) {
     if (key_definitions[i].required) {
@@ -2571,64 +2867,64 @@ validate_type_keys (kf_validator *kf)
     case INVALID_TYPE:
       break;
     case APPLICATION_TYPE:
-      g_list_foreach (kf->link_keys,
-                      (GFunc) print_error_foreach_link_key, kf);
-      g_list_foreach (kf->fsdevice_keys,
-                      (GFunc) print_error_foreach_fsdevice_key, kf);
-      g_list_foreach (kf->mimetype_keys,
-                      (GFunc) print_error_foreach_mimetype_key, kf);
-      retval = (g_list_length (kf->link_keys) +
-                g_list_length (kf->fsdevice_keys) +
-                g_list_length (kf->mimetype_keys) == 0);
+      g_ptr_array_foreach (kf->link_keys,
+                           (GFunc) print_error_foreach_link_key, kf);
+      g_ptr_array_foreach (kf->fsdevice_keys,
+                           (GFunc) print_error_foreach_fsdevice_key, kf);
+      g_ptr_array_foreach (kf->mimetype_keys,
+                           (GFunc) print_error_foreach_mimetype_key, kf);
+      retval = (kf->link_keys->len +
+                kf->fsdevice_keys->len +
+                kf->mimetype_keys->len == 0);
       break;
     case LINK_TYPE:
-      g_list_foreach (kf->application_keys,
-                      (GFunc) print_error_foreach_application_key, kf);
-      g_list_foreach (kf->fsdevice_keys,
-                      (GFunc) print_error_foreach_fsdevice_key, kf);
-      g_list_foreach (kf->mimetype_keys,
-                      (GFunc) print_error_foreach_mimetype_key, kf);
-      retval = (g_list_length (kf->application_keys) +
-                g_list_length (kf->fsdevice_keys) +
-                g_list_length (kf->mimetype_keys) == 0);
+      g_ptr_array_foreach (kf->application_keys,
+                           (GFunc) print_error_foreach_application_key, kf);
+      g_ptr_array_foreach (kf->fsdevice_keys,
+                           (GFunc) print_error_foreach_fsdevice_key, kf);
+      g_ptr_array_foreach (kf->mimetype_keys,
+                           (GFunc) print_error_foreach_mimetype_key, kf);
+      retval = (kf->application_keys->len +
+                kf->fsdevice_keys->len +
+                kf->mimetype_keys->len == 0);
       break;
     case DIRECTORY_TYPE:
     case SERVICE_TYPE:
     case SERVICE_TYPE_TYPE:
-      g_list_foreach (kf->application_keys,
-                      (GFunc) print_error_foreach_application_key, kf);
-      g_list_foreach (kf->link_keys,
-                      (GFunc) print_error_foreach_link_key, kf);
-      g_list_foreach (kf->fsdevice_keys,
-                      (GFunc) print_error_foreach_fsdevice_key, kf);
-      g_list_foreach (kf->mimetype_keys,
-                      (GFunc) print_error_foreach_mimetype_key, kf);
-      retval = (g_list_length (kf->application_keys) +
-                g_list_length (kf->link_keys) +
-                g_list_length (kf->fsdevice_keys) +
-                g_list_length (kf->mimetype_keys) == 0);
+      g_ptr_array_foreach (kf->application_keys,
+                           (GFunc) print_error_foreach_application_key, kf);
+      g_ptr_array_foreach (kf->link_keys,
+                           (GFunc) print_error_foreach_link_key, kf);
+      g_ptr_array_foreach (kf->fsdevice_keys,
+                           (GFunc) print_error_foreach_fsdevice_key, kf);
+      g_ptr_array_foreach (kf->mimetype_keys,
+                           (GFunc) print_error_foreach_mimetype_key, kf);
+      retval = (kf->application_keys->len +
+                kf->link_keys->len +
+                kf->fsdevice_keys->len +
+                kf->mimetype_keys->len == 0);
       break;
     case FSDEVICE_TYPE:
-      g_list_foreach (kf->application_keys,
-                      (GFunc) print_error_foreach_application_key, kf);
-      g_list_foreach (kf->link_keys,
-                      (GFunc) print_error_foreach_link_key, kf);
-      g_list_foreach (kf->mimetype_keys,
-                      (GFunc) print_error_foreach_mimetype_key, kf);
-      retval = (g_list_length (kf->application_keys) +
-                g_list_length (kf->link_keys) +
-                g_list_length (kf->mimetype_keys) == 0);
+      g_ptr_array_foreach (kf->application_keys,
+                           (GFunc) print_error_foreach_application_key, kf);
+      g_ptr_array_foreach (kf->link_keys,
+                           (GFunc) print_error_foreach_link_key, kf);
+      g_ptr_array_foreach (kf->mimetype_keys,
+                           (GFunc) print_error_foreach_mimetype_key, kf);
+      retval = (kf->application_keys->len +
+                kf->link_keys->len +
+                kf->mimetype_keys->len == 0);
       break;
     case MIMETYPE_TYPE:
-      g_list_foreach (kf->application_keys,
-                      (GFunc) print_error_foreach_application_key, kf);
-      g_list_foreach (kf->link_keys,
-                      (GFunc) print_error_foreach_link_key, kf);
-      g_list_foreach (kf->fsdevice_keys,
-                      (GFunc) print_error_foreach_fsdevice_key, kf);
-      retval = (g_list_length (kf->application_keys) +
-                g_list_length (kf->link_keys) +
-                g_list_length (kf->fsdevice_keys) == 0);
+      g_ptr_array_foreach (kf->application_keys,
+                           (GFunc) print_error_foreach_application_key, kf);
+      g_ptr_array_foreach (kf->link_keys,
+                           (GFunc) print_error_foreach_link_key, kf);
+      g_ptr_array_foreach (kf->fsdevice_keys,
+                           (GFunc) print_error_foreach_fsdevice_key, kf);
+      retval = (kf->application_keys->len +
+                kf->link_keys->len +
+                kf->fsdevice_keys->len == 0);
       break;
     case LAST_TYPE:
       g_assert_not_reached ();
@@ -2749,23 +3045,25 @@ validate_line_looks_like_group (kf_validator  *kf,
                                 const char    *line,
                                 char         **group)
 {
-  char     *chomped;
+  gsize     len;
+  gsize     chomped_len;
   gboolean  result;
 
-  chomped = g_strdup (line);
-  g_strchomp (chomped);
+  len = strlen (line);
+  chomped_len = len;
+  while (chomped_len > 0 && g_ascii_isspace (line[chomped_len - 1]))
+    chomped_len--;
 
-  result = (*chomped == '[' && chomped[strlen (chomped) - 1] == ']');
+  result = (chomped_len > 0 &&
+            line[0] == '[' && line[chomped_len - 1] == ']');
 
-  if (result && strcmp (chomped, line))
+  if (result && chomped_len != len)
     print_fatal (kf, "line \"%s\" ends with a space, but looks like a group. "
                      "The validation will continue, with the trailing spaces "
                      "ignored.\n", line);
 
   if (group && result)
-    *group = g_strndup (chomped + 1, strlen (chomped) - 2);
-
-  g_free (chomped);
+    *group = dfu_arena_strndup (kf->arena, line + 1, chomped_len - 2);
 
   return result;
 }
@@ -2773,10 +3071,12 @@ validate_line_looks_like_group (kf_validator  *kf,
 /* + Space before and after the equals sign should be ignored; the = sign is
  *   the actual delimiter.
  *   Checked.
+ *
+ * If key and value are given, they are split in place from line.
  */
 static gboolean
 validate_line_looks_like_entry (kf_validator  *kf,
-                                const char    *line,
+                                char          *line,
                                 char         **key,
                                 char         **value)
 {
@@ -2791,13 +3091,14 @@ validate_line_looks_like_entry (kf_validator  *kf,
   if (*p == line[0])
     return FALSE;
 
-  if (key) {
-    *key = g_strndup (line, p - line);
-    g_strchomp (*key);
-  }
   if (value) {
-    *value = g_strdup (p + 1);
-    g_strchug (*value);
+    *value = p + 1;
+    while (g_ascii_isspace (**value))
+      (*value)++;
+  }
+  if (key) {
+    *p = '\0';
+    *key = g_strchomp (line);
   }
 
   return TRUE;
@@ -2811,18 +3112,18 @@ validate_line_looks_like_entry (kf_validator  *kf,
  *   Checked.
  */
 static void
-validate_parse_line (kf_validator *kf)
+validate_parse_line (kf_validator *kf,
+                     char         *line,
+                     gsize         len,
+                     guint         line_flags)
 {
-  char *line;
-  int   len;
   char *group;
   char *key;
   char *value;
 
-  line = kf->parse_buffer->str;
-  len  = kf->parse_buffer->len;
-
-  if (!kf->utf8_warning && !g_utf8_validate (line, len, NULL)) {
+  /* a nul byte is a control character, and is not valid either */
+  if (!kf->utf8_warning && line_flags != 0 &&
+      !g_utf8_validate (line, len, NULL)) {
     print_warning (kf, "file contains lines that are not UTF-8 encoded. There "
                        "is no guarantee the validator will correctly work.\n");
     kf->utf8_warning = TRUE;
@@ -2850,41 +3151,47 @@ validate_parse_line (kf_validator *kf)
     if (kf->current_group && strcmp (kf->current_group, group))
       validate_keys_for_current_group (kf);
 
-    if (g_hash_table_lookup_extended (kf->groups, group, NULL, NULL)) {
+    kf->current_group_data = lookup_group (kf, group);
+    if (kf->current_group_data) {
       print_fatal (kf, "file contains multiple groups named \"%s\", but "
                        "multiple groups may not have the same name\n", group);
     } else {
       validate_group_name (kf, group);
-      g_hash_table_insert (kf->groups, g_strdup (group), NULL);
+      kf->current_group_data = add_group (kf, group);
     }
 
-    if (kf->current_group)
-      g_free (kf->current_group);
     kf->current_group = group;
 
     return;
   }
 
+  /* the line is still needed for the error if there is no group yet */
   key = NULL;
   value = NULL;
-  if (validate_line_looks_like_entry (kf, line, &key, &value)) {
+  if (validate_line_looks_like_entry (kf, line,
+                                      kf->current_group ? &key : NULL,
+                                      kf->current_group ? &value : NULL)) {
     if (kf->current_group) {
-      GSList      *keys;
+      kf_group    *data;
       kf_keyvalue *keyvalue;
 
-      keyvalue = g_slice_new (kf_keyvalue);
+      data = kf->current_group_data;
+      if (data->n_keys == data->n_allocated_keys) {
+        guint n_allocated;
+
+        n_allocated = MAX (16, 2 * data->n_allocated_keys);
+        data->keys = dfu_arena_realloc (kf->arena, data->keys,
+                                        data->n_allocated_keys *
+                                        sizeof (kf_keyvalue),
+                                        n_allocated * sizeof (kf_keyvalue));
+        data->n_allocated_keys = n_allocated;
+      }
+
+      keyvalue = &data->keys[data->n_keys++];
       keyvalue->key = key;
       keyvalue->value = value;
-
-      keys = g_hash_table_lookup (kf->groups, kf->current_group);
-      keys = g_slist_prepend (keys, keyvalue);
-      g_hash_table_replace (kf->groups, g_strdup (kf->current_group), keys);
+      keyvalue->line_flags = line_flags;
     } else {
-      if (key)
-        g_free (key);
-      if (value)
-        g_free (value);
-
       print_fatal (kf, "file contains entry \"%s\" before the first group, "
                        "but only comments are accepted before the first "
                        "group\n", line);
@@ -2897,92 +3204,168 @@ validate_parse_line (kf_validator *kf)
                    "a group or an entry\n", line);
 }
 
+/* Returns the end of the line starting at line, that is its first '\n' or
+ * '\r', and sets line_flags to what the line contains. The data must end
+ * with a '\n', followed by LINE_SCAN_PADDING readable bytes: with SSE2, the
+ * line is read 16 bytes at a time, and the bytes after its end are ignored.
+ */
+#define LINE_SCAN_PADDING 15
+
+static char *
+scan_line (char  *line,
+           guint *line_flags)
+{
+  guint flags;
+  char *p;
+
+  flags = 0;
+
+#ifdef __SSE2__
+  for (p = line; ; p += 16) {
+    __m128i chunk;
+    int     eol_mask;
+    int     non_ascii_mask;
+    int     control_mask;
+
+    chunk = _mm_loadu_si128 ((const __m128i *) p);
+    eol_mask = _mm_movemask_epi8 (
+        _mm_or_si128 (_mm_cmpeq_epi8 (chunk, _mm_set1_epi8 ('\n')),
+                      _mm_cmpeq_epi8 (chunk, _mm_set1_epi8 ('\r'))));
+    non_ascii_mask = _mm_movemask_epi8 (chunk);
+    /* the comparison is signed, so non-ASCII bytes are below ' ' too */
+    control_mask = _mm_movemask_epi8 (
+        _mm_or_si128 (_mm_cmplt_epi8 (chunk, _mm_set1_epi8 (' ')),
+                      _mm_cmpeq_epi8 (chunk, _mm_set1_epi8 (0x7f))));
+    control_mask &= ~non_ascii_mask;
+
+    if (eol_mask != 0) {
+      int before_eol;
+
+      /* only look at the bytes before the end of the line */
+      before_eol = (eol_mask & -eol_mask) - 1;
+      non_ascii_mask &= before_eol;
+      control_mask &= before_eol;
+    }
+
+    if (non_ascii_mask != 0)
+      flags |= LINE_HAS_NON_ASCII;
+    if (control_mask != 0)
+      flags |= LINE_HAS_CONTROL;
+
+    if (eol_mask != 0) {
+      p += __builtin_ctz (eol_mask);
+      break;
+    }
+  }
+#else
+  for (p = line; *p != '\n' && *p != '\r'; p++) {
+    if ((guchar) *p >= 0x80)
+      flags |= LINE_HAS_NON_ASCII;
+    else if (g_ascii_iscntrl (*p))
+      flags |= LINE_HAS_CONTROL;
+  }
+#endif
+
+  *line_flags = flags;
+
+  return p;
+}
+
 /* + Desktop entry files are encoded as lines of 8-bit characters separated by
  *   LF characters.
  *   Checked.
+ *
+ * The lines are nul-terminated in place: data must have room for one more
+ * byte after length, followed by LINE_SCAN_PADDING bytes.
  */
 static void
 validate_parse_data (kf_validator *kf,
                      char         *data,
-                     int           length)
+                     gsize         length)
 {
-  int i;
-
-  for (i = 0; i < length; i++) {
-    if (data[i] == '\n') {
-      if (i > 0 && data[i - 1] == '\r') {
-        g_string_erase (kf->parse_buffer, kf->parse_buffer->len - 1, 1);
-
-        if (!kf->cr_error) {
-          print_fatal (kf, "file contains at least one line ending with a "
-                           "carriage return before the line feed, while lines "
-                           "should only be separated by a line feed "
-                           "character. First such line is: \"%s\"\n",
-                           kf->parse_buffer->str);
-          kf->cr_error = TRUE;
-        }
-      }
-
-      if (kf->parse_buffer->len > 0) {
-        validate_parse_line (kf);
-        g_string_erase (kf->parse_buffer, 0, -1);
-      }
+  char  *line;
+  char  *end;
+  char  *eol;
+  guint  line_flags;
+
+  line = data;
+  end  = data + length;
+
+  /* the last line always ends with a line feed, so that scan_line() stops
+   * there */
+  *end = '\n';
+  memset (end + 1, 0, LINE_SCAN_PADDING);
+
+  while (line < end) {
+    eol = scan_line (line, &line_flags);
+
+    /* a carriage return ends a line too */
+    if (*eol == '\r' && !kf->cr_error) {
+      *eol = '\0';
+      print_fatal (kf, "file contains at least one line ending with a "
+                       "carriage return, while lines should only be "
+                       "separated by a line feed character. First such "
+                       "line is: \"%s\"\n", line);
+      kf->cr_error = TRUE;
+    }
 
-    } else if (data[i] == '\r') {
-        if (!kf->cr_error) {
-          print_fatal (kf, "file contains at least one line ending with a "
-                           "carriage return, while lines should only be "
-                           "separated by a line feed character. First such "
-                           "line is: \"%s\"\n", kf->parse_buffer->str);
-          kf->cr_error = TRUE;
-        }
+    *eol = '\0';
+    if (eol > line)
+      validate_parse_line (kf, line, eol - line, line_flags);
 
-        data[i] = '\n';
-        i--;
-    } else
-      g_string_append_c (kf->parse_buffer, data[i]);
+    line = eol + 1;
   }
 }
 
-static void
-validate_flush_parse_buffer (kf_validator *kf)
-{
-  if (kf->parse_buffer->len > 0) {
-      validate_parse_line (kf);
-      g_string_erase (kf->parse_buffer, 0, -1);
-  }
+/* Initial size of the buffer to read a file whose size is not known */
+#define STREAM_BUFFER_SIZE 4096
 
-  if (kf->current_group)
-    validate_keys_for_current_group (kf);
-}
-
-#define VALIDATE_READ_SIZE 4096
+/* The file is read at once, and its lines are validated where they are in
+ * the buffer, without being copied: the keys and values point to it, so it
+ * lives in the arena until the end of the validation. */
 static gboolean
 validate_parse_from_fd (kf_validator *kf,
                         int           fd)
 {
-  int         bytes_read;
   struct stat stat_buf;
-  char        read_buf[VALIDATE_READ_SIZE];
+  char       *data;
+  gsize       size;
+  gsize       length;
+  ssize_t     bytes_read;
+  int         errsv;
 
   if (fstat (fd, &stat_buf) < 0) {
     print_fatal (kf, "while reading the file: %s\n", g_strerror (errno));
     return FALSE;
   }
 
-  if (!S_ISREG (stat_buf.st_mode)) {
+  if (S_ISDIR (stat_buf.st_mode)) {
     print_fatal (kf, "file is not a regular file\n");
     return FALSE;
   }
 
-  if (stat_buf.st_size == 0) {
-    print_fatal (kf, "file is empty\n");
-    return FALSE;
-  }
+  /* one more byte to terminate the last line, and one to see the end of
+   * the file without growing the buffer; the padding is not read into. The
+   * size of a pipe or a socket is not known: the buffer grows as needed. */
+  if (S_ISREG (stat_buf.st_mode) && stat_buf.st_size > 0)
+    size = stat_buf.st_size + 2;
+  else
+    size = STREAM_BUFFER_SIZE;
+  data = dfu_arena_alloc (kf->arena, size + LINE_SCAN_PADDING);
+  length = 0;
+  errsv = 0;
 
-  bytes_read = 0;
   while (1) {
-    bytes_read = read (fd, read_buf, VALIDATE_READ_SIZE);
+    if (length == size - 1) {
+      char *bigger;
+
+      size *= 2;
+      bigger = dfu_arena_alloc (kf->arena, size + LINE_SCAN_PADDING);
+      memcpy (bigger, data, length);
+      data = bigger;
+    }
+
+    bytes_read = read (fd, data + length, size - 1 - length);
 
     if (bytes_read == 0)  /* End of File */
       break;
@@ -2992,25 +3375,59 @@ validate_parse_from_fd (kf_validator *kf,
         continue;
 
       /* let's validate what we already have */
-      validate_flush_parse_buffer (kf);
-
-      print_fatal (kf, "while reading the file: %s\n", g_strerror (errno));
-      return FALSE;
+      errsv = errno;
+      break;
     }
 
-    validate_parse_data (kf, read_buf, bytes_read);
+    length += bytes_read;
+  }
+
+  if (length == 0 && errsv == 0) {
+    print_fatal (kf, "file is empty\n");
+    return FALSE;
   }
 
-  validate_flush_parse_buffer (kf);
+  validate_parse_data (kf, data, length);
+
+  if (kf->current_group)
+    validate_keys_for_current_group (kf);
+
+  if (errsv != 0) {
+    print_fatal (kf, "while reading the file: %s\n", g_strerror (errsv));
+    return FALSE;
+  }
 
   return TRUE;
 }
 
+/* Like validate_parse_from_fd(), for contents that were already read */
+static void
+validate_parse_contents (kf_validator *kf,
+                         const char   *contents,
+                         gsize         length)
+{
+  char *data;
+
+  if (length == 0) {
+    print_fatal (kf, "file is empty\n");
+    return;
+  }
+
+  data = dfu_arena_alloc (kf->arena, length + 1 + LINE_SCAN_PADDING);
+  memcpy (data, contents, length);
+
+  validate_parse_data (kf, data, length);
+
+  if (kf->current_group)
+    validate_keys_for_current_group (kf);
+}
+
 static gboolean
 validate_load_and_parse (kf_validator *kf)
 {
-  int      fd;
-  gboolean ret;
+  struct stat stat_buf;
+  int         fd;
+  gboolean    ret;
 
   fd = g_open (kf->filename, O_RDONLY, 0);
 
@@ -3019,6 +3436,13 @@ validate_load_and_parse (kf_validator *kf)
     return FALSE;
   }
 
+  /* reading a device or a fifo could block or never end */
+  if (fstat (fd, &stat_buf) == 0 && !S_ISREG (stat_buf.st_mode)) {
+    print_fatal (kf, "file is not a regular file\n");
+    close (fd);
+    return FALSE;
+  }
+
   ret = validate_parse_from_fd (kf, fd);
 
   close (fd);
@@ -3026,67 +3450,156 @@ validate_load_and_parse (kf_validator *kf)
   return ret;
 }
 
-static gboolean
-groups_hashtable_free (gpointer key,
-                       gpointer value,
-                       gpointer data)
+struct _DfuValidator {
+  gboolean                 warn_kde;
+  gboolean                 no_warn_deprecated;
+  gboolean                 no_hints;
+  DfuValidatorMessageFunc  message_func;
+  gpointer                 message_data;
+
+  /* kept from one file to the next: they are emptied, not freed, once a file
+   * has been validated */
+  DfuArena                *arena;
+  GHashTable              *group_indexes;
+  GHashTable              *current_keys;
+  GHashTable              *duplicated_keys;
+  GHashTable              *action_values;
+  GHashTable              *action_groups;
+  GPtrArray               *application_keys;
+  GPtrArray               *link_keys;
+  GPtrArray               *fsdevice_keys;
+  GPtrArray               *mimetype_keys;
+};
+
+DfuValidator *
+dfu_validator_new (void)
 {
-  GSList *list;
-  GSList *sl;
+  static GOnce  lookup_tables_once = G_ONCE_INIT;
+  DfuValidator *validator;
 
-  list = (GSList *) value;
-  for (sl = list; sl != NULL; sl = sl->next) {
-    kf_keyvalue *keyvalue;
+  /* just a consistency check */
+  g_assert (G_N_ELEMENTS (registered_types) == LAST_TYPE - 1);
 
-    keyvalue = (kf_keyvalue *) sl->data;
-    g_free (keyvalue->key);
-    g_free (keyvalue->value);
-    g_slice_free (kf_keyvalue, keyvalue);
-  }
+  g_once (&lookup_tables_once, init_lookup_tables, NULL);
 
-  g_slist_free (list);
+  validator = g_new0 (DfuValidator, 1);
 
-  return TRUE;
+  validator->arena            = dfu_arena_new ();
+  validator->group_indexes    = g_hash_table_new (g_str_hash, g_str_equal);
+  validator->current_keys     = g_hash_table_new (g_str_hash, g_str_equal);
+  validator->duplicated_keys  = g_hash_table_new (g_str_hash, g_str_equal);
+  validator->action_values    = g_hash_table_new (g_str_hash, g_str_equal);
+  validator->action_groups    = g_hash_table_new (g_str_hash, g_str_equal);
+  validator->application_keys = g_ptr_array_new ();
+  validator->link_keys        = g_ptr_array_new ();
+  validator->fsdevice_keys    = g_ptr_array_new ();
+  validator->mimetype_keys    = g_ptr_array_new ();
+
+  return validator;
 }
 
-gboolean
-desktop_file_validate (const char *filename,
-                       gboolean    warn_kde,
-                       gboolean    no_warn_deprecated,
-                       gboolean    no_hints)
+void
+dfu_validator_free (DfuValidator *validator)
 {
-  kf_validator kf;
+  if (validator == NULL)
+    return;
 
-  /* just a consistency check */
-  g_assert (G_N_ELEMENTS (registered_types) == LAST_TYPE - 1);
+  g_ptr_array_free (validator->application_keys, TRUE);
+  g_ptr_array_free (validator->link_keys, TRUE);
+  g_ptr_array_free (validator->fsdevice_keys, TRUE);
+  g_ptr_array_free (validator->mimetype_keys, TRUE);
+  g_hash_table_destroy (validator->group_indexes);
+  g_hash_table_destroy (validator->current_keys);
+  g_hash_table_destroy (validator->duplicated_keys);
+  g_hash_table_destroy (validator->action_values);
+  g_hash_table_destroy (validator->action_groups);
+  dfu_arena_free (validator->arena);
+
+  g_free (validator);
+}
+
+void
+dfu_validator_set_warn_kde (DfuValidator *validator,
+                            gboolean      warn_kde)
+{
+  validator->warn_kde = warn_kde;
+}
+
+void
+dfu_validator_set_no_warn_deprecated (DfuValidator *validator,
+                                      gboolean      no_warn_deprecated)
+{
+  validator->no_warn_deprecated = no_warn_deprecated;
+}
+
+void
+dfu_validator_set_no_hints (DfuValidator *validator,
+                            gboolean      no_hints)
+{
+  validator->no_hints = no_hints;
+}
+
+/* Messages are given to func instead of being printed; with a NULL func,
+ * they are printed again */
+void
+dfu_validator_set_message_func (DfuValidator            *validator,
+                                DfuValidatorMessageFunc  func,
+                                gpointer                 user_data)
+{
+  validator->message_func = func;
+  validator->message_data = user_data;
+}
+
+/* Validates contents if it is not NULL, or what can be read from fd if it is
+ * not -1, or else the file. The messages are appended to output if it is not
+ * NULL. */
+static gboolean
+validator_run (DfuValidator *validator,
+               const char   *filename,
+               int           fd,
+               const char   *contents,
+               gsize         length,
+               GString      *output)
+{
+  kf_validator kf;
 
   kf.filename               = filename;
-  kf.parse_buffer           = g_string_new ("");
+  kf.output                 = output;
+  kf.message_func           = validator->message_func;
+  kf.message_data           = validator->message_data;
+  kf.arena                  = validator->arena;
   kf.utf8_warning           = FALSE;
   kf.cr_error               = FALSE;
   kf.current_group          = NULL;
-  kf.groups                 = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                                     g_free, NULL);
-  kf.current_keys           = NULL;
-  kf.kde_reserved_warnings  = warn_kde;
-  kf.no_deprecated_warnings = no_warn_deprecated;
-  kf.no_hints               = no_hints;
+  kf.current_group_data     = NULL;
+  kf.groups                 = NULL;
+  kf.n_groups               = 0;
+  kf.n_allocated_groups     = 0;
+  kf.group_indexes          = validator->group_indexes;
+  kf.current_keys           = validator->current_keys;
+  kf.duplicated_keys        = validator->duplicated_keys;
+  kf.kde_reserved_warnings  = validator->warn_kde;
+  kf.no_deprecated_warnings = validator->no_warn_deprecated;
+  kf.no_hints               = validator->no_hints;
 
   kf.main_group       = NULL;
   kf.type             = INVALID_TYPE;
   kf.type_string      = NULL;
   kf.show_in          = FALSE;
-  kf.application_keys = NULL;
-  kf.link_keys        = NULL;
-  kf.fsdevice_keys    = NULL;
-  kf.mimetype_keys    = NULL;
-  kf.action_values    = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                               NULL, g_free);
-  kf.action_groups    = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                               NULL, g_free);
+  kf.application_keys = validator->application_keys;
+  kf.link_keys        = validator->link_keys;
+  kf.fsdevice_keys    = validator->fsdevice_keys;
+  kf.mimetype_keys    = validator->mimetype_keys;
+  kf.action_values    = validator->action_values;
+  kf.action_groups    = validator->action_groups;
   kf.fatal_error      = FALSE;
 
-  validate_load_and_parse (&kf);
+  if (contents)
+    validate_parse_contents (&kf, contents, length);
+  else if (fd >= 0)
+    validate_parse_from_fd (&kf, fd);
+  else
+    validate_load_and_parse (&kf);
   //FIXME: this does not work well if there are both a Desktop Entry and a KDE
   //Desktop Entry groups since only the last one will be validated for this.
   if (kf.main_group) {
@@ -3096,30 +3609,149 @@ desktop_file_validate (const char *filename,
   validate_actions (&kf);
   validate_filename (&kf);
 
-  g_list_foreach (kf.application_keys, (GFunc) g_free, NULL);
-  g_list_free (kf.application_keys);
-  g_list_foreach (kf.link_keys, (GFunc) g_free, NULL);
-  g_list_free (kf.link_keys);
-  g_list_foreach (kf.fsdevice_keys, (GFunc) g_free, NULL);
-  g_list_free (kf.fsdevice_keys);
-  g_list_foreach (kf.mimetype_keys, (GFunc) g_free, NULL);
-  g_list_free (kf.mimetype_keys);
-
-  g_hash_table_destroy (kf.action_values);
-  g_hash_table_destroy (kf.action_groups);
-
-  g_assert (kf.current_keys == NULL);
-  /* we can't add an automatic destroy handler for the value because we replace
-   * it when adding keys, and this means we'd have to copy the value each time
-   * we replace it */
-  g_hash_table_foreach_remove (kf.groups, groups_hashtable_free, NULL);
-  g_hash_table_destroy (kf.groups);
-  g_free (kf.current_group);
-  g_string_free (kf.parse_buffer, TRUE);
+  g_ptr_array_set_size (validator->application_keys, 0);
+  g_ptr_array_set_size (validator->link_keys, 0);
+  g_ptr_array_set_size (validator->fsdevice_keys, 0);
+  g_ptr_array_set_size (validator->mimetype_keys, 0);
+  g_hash_table_remove_all (validator->action_values);
+  g_hash_table_remove_all (validator->action_groups);
+  g_hash_table_remove_all (validator->group_indexes);
+
+  /* all the strings of the hash tables and arrays were in the arena */
+  dfu_arena_reset (validator->arena);
 
   return (!kf.fatal_error);
 }
 
+gboolean
+dfu_validator_validate_file (DfuValidator *validator,
+                             const char   *filename)
+{
+  g_return_val_if_fail (validator != NULL, FALSE);
+  g_return_val_if_fail (filename != NULL, FALSE);
+
+  return validator_run (validator, filename, -1, NULL, 0, NULL);
+}
+
+/* Validates what can be read from fd, which is not closed; filename is only
+ * used in the messages and to check the extension */
+gboolean
+dfu_validator_validate_fd (DfuValidator *validator,
+                           const char   *filename,
+                           int           fd)
+{
+  g_return_val_if_fail (validator != NULL, FALSE);
+  g_return_val_if_fail (filename != NULL, FALSE);
+  g_return_val_if_fail (fd >= 0, FALSE);
+
+  return validator_run (validator, filename, fd, NULL, 0, NULL);
+}
+
+/* Like dfu_validator_validate_fd(), for contents that were already read */
+gboolean
+dfu_validator_validate_buffer (DfuValidator *validator,
+                               const char   *filename,
+                               const char   *contents,
+                               gsize         length)
+{
+  g_return_val_if_fail (validator != NULL, FALSE);
+  g_return_val_if_fail (filename != NULL, FALSE);
+  g_return_val_if_fail (contents != NULL, FALSE);
+
+  return validator_run (validator, filename, -1, contents, length, NULL);
+}
+
+/* Each thread keeps its validator from one file to the next */
+#if GLIB_CHECK_VERSION (2, 32, 0)
+static GPrivate thread_validator = G_PRIVATE_INIT ((GDestroyNotify) dfu_validator_free);
+#else
+static GStaticPrivate thread_validator = G_STATIC_PRIVATE_INIT;
+#endif
+
+static DfuValidator *
+get_thread_validator (void)
+{
+  DfuValidator *validator;
+
+#if GLIB_CHECK_VERSION (2, 32, 0)
+  validator = g_private_get (&thread_validator);
+  if (!validator) {
+    validator = dfu_validator_new ();
+    g_private_set (&thread_validator, validator);
+  }
+#else
+  validator = g_static_private_get (&thread_validator);
+  if (!validator) {
+    validator = dfu_validator_new ();
+    g_static_private_set (&thread_validator, validator,
+                          (GDestroyNotify) dfu_validator_free);
+  }
+#endif
+
+  return validator;
+}
+
+gboolean
+desktop_file_validate (const char *filename,
+                       gboolean    warn_kde,
+                       gboolean    no_warn_deprecated,
+                       gboolean    no_hints)
+{
+  return desktop_file_validate_full (filename, warn_kde, no_warn_deprecated,
+                                     no_hints, NULL);
+}
+
+/* Validates the file, or contents if it is not NULL */
+static gboolean
+validate_file_or_contents (const char *filename,
+                           const char *contents,
+                           gsize       length,
+                           gboolean    warn_kde,
+                           gboolean    no_warn_deprecated,
+                           gboolean    no_hints,
+                           GString    *output)
+{
+  DfuValidator *validator;
+
+  validator = get_thread_validator ();
+  validator->warn_kde           = warn_kde;
+  validator->no_warn_deprecated = no_warn_deprecated;
+  validator->no_hints           = no_hints;
+
+  return validator_run (validator, filename, -1, contents, length, output);
+}
+
+/* Like desktop_file_validate(), but if output is not NULL, the messages are
+ * appended to it instead of being printed. Files can be validated in
+ * several threads at once this way. */
+gboolean
+desktop_file_validate_full (const char *filename,
+                            gboolean    warn_kde,
+                            gboolean    no_warn_deprecated,
+                            gboolean    no_hints,
+                            GString    *output)
+{
+  return validate_file_or_contents (filename, NULL, 0, warn_kde,
+                                    no_warn_deprecated, no_hints, output);
+}
+
+/* Like desktop_file_validate_full(), for the contents of filename, that were
+ * already read: the result only depends on the contents, and on filename */
+gboolean
+desktop_file_validate_contents (const char *filename,
+                                const char *contents,
+                                gsize       length,
+                                gboolean    warn_kde,
+                                gboolean    no_warn_deprecated,
+                                gboolean    no_hints,
+                                GString    *output)
+{
+  g_return_val_if_fail (contents != NULL, FALSE);
+
+  return validate_file_or_contents (filename, contents, length, warn_kde,
+                                    no_warn_deprecated, no_hints, output);
+}
+
 /* return FALSE if we were unable to fix the file */
 gboolean
 desktop_file_fixup (GKeyFile   *keyfile,
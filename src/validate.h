@@ -36,6 +36,64 @@ gboolean desktop_file_validate (const char *filename,
 				gboolean    warn_kde,
 				gboolean    no_warn_deprecated,
 				gboolean    no_hints);
+gboolean desktop_file_validate_full (const char *filename,
+                                     gboolean    warn_kde,
+                                     gboolean    no_warn_deprecated,
+                                     gboolean    no_hints,
+                                     GString    *output);
+gboolean desktop_file_validate_contents (const char *filename,
+                                         const char *contents,
+                                         gsize       length,
+                                         gboolean    warn_kde,
+                                         gboolean    no_warn_deprecated,
+                                         gboolean    no_hints,
+                                         GString    *output);
 gboolean desktop_file_fixup    (GKeyFile   *keyfile,
                                 const char *filename);
 
+/* A validator keeps its options, and the memory it uses to validate a file,
+ * from one file to the next: it is faster than desktop_file_validate() to
+ * validate many files. A validator must only be used by one thread at a
+ * time. */
+typedef struct _DfuValidator DfuValidator;
+
+typedef enum {
+  DFU_VALIDATOR_ERROR,
+  DFU_VALIDATOR_FUTURE_ERROR,
+  DFU_VALIDATOR_WARNING,
+  DFU_VALIDATOR_HINT
+} DfuValidatorLevel;
+
+/* message is not followed by a line feed, and is only valid during the
+ * call; the validator must not be used from this function */
+typedef void (*DfuValidatorMessageFunc) (const char        *filename,
+                                         DfuValidatorLevel  level,
+                                         const char        *message,
+                                         gpointer           user_data);
+
+DfuValidator *dfu_validator_new                    (void);
+void          dfu_validator_free                   (DfuValidator            *validator);
+
+void          dfu_validator_set_warn_kde           (DfuValidator            *validator,
+                                                    gboolean                 warn_kde);
+void          dfu_validator_set_no_warn_deprecated (DfuValidator            *validator,
+                                                    gboolean                 no_warn_deprecated);
+void          dfu_validator_set_no_hints           (DfuValidator            *validator,
+                                                    gboolean                 no_hints);
+void          dfu_validator_set_message_func       (DfuValidator            *validator,
+                                                    DfuValidatorMessageFunc  func,
+                                                    gpointer                 user_data);
+
+/* dfu_validator_validate_file() only validates regular files, while
+ * dfu_validator_validate_fd() reads anything but a directory until the end of
+ * the file, such as a pipe or a socket. */
+gboolean      dfu_validator_validate_file          (DfuValidator            *validator,
+                                                    const char              *filename);
+gboolean      dfu_validator_validate_fd            (DfuValidator            *validator,
+                                                    const char              *filename,
+                                                    int                      fd);
+gboolean      dfu_validator_validate_buffer        (DfuValidator            *validator,
+                                                    const char              *filename,
+                                                    const char              *contents,
+                                                    gsize                    length);
+
@@ -26,27 +26,474 @@
  * USA.
  */
 
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <glib/gstdio.h>
+
+#include "filereader.h"
 #include "validate.h"
 
+/* Number of files the kernel is asked to read ahead while validating */
+#define READAHEAD_FILES 16
+
+/* With --jobs, number of files queued for each worker thread: the messages
+ * of a file are only printed once those of the previous files have been */
+#define QUEUED_FILES_PER_JOB 16
+
+/* With --cache, the least recently used results are removed once the cache
+ * takes more than CACHE_MAX_SIZE bytes, until it takes less than 3/4 of it.
+ * Results are small: they are counted as if they used whole disk blocks. */
+#define CACHE_MAX_SIZE   (32 * 1024 * 1024)
+#define CACHE_BLOCK_SIZE 4096
+
+/* The modification time of a result is the last time it was used, give or
+ * take this number of seconds: it is not updated each time */
+#define CACHE_TOUCH_INTERVAL 3600
+
+/* Results are only reused by the same version of the validator */
+#define CACHE_KEY_PREFIX "desktop-file-validate " VERSION
+
+typedef struct {
+  const char *filename;
+  GString    *output;
+  gboolean    exists;
+  gboolean    valid;
+  gboolean    done;
+} ValidateJob;
+
+typedef struct {
+  char    *path;
+  time_t   mtime;
+  goffset  size;
+} CacheEntry;
+
 static gboolean   warn_kde = FALSE;
 static gboolean   no_hints = FALSE;
 static gboolean   no_warn_deprecated = FALSE;
+static gboolean   drop_cache = FALSE;
+static int        n_jobs = 1;
+static char      *cache_dir = NULL;
+static gint       cache_written = FALSE;
 static char     **filename = NULL;
 
 static GOptionEntry option_entries[] = {
   { "no-hints", 0, 0, G_OPTION_ARG_NONE, &no_hints, "Do not output hints to improve desktop file", NULL },
   { "no-warn-deprecated", 0, 0, G_OPTION_ARG_NONE, &no_warn_deprecated, "Do not warn about usage of deprecated items", NULL },
   { "warn-kde", 0, 0, G_OPTION_ARG_NONE, &warn_kde, "Warn if KDE extensions to the specification are used", NULL },
+  { "drop-cache", 0, 0, G_OPTION_ARG_NONE, &drop_cache, "Tell the system that the files will not be needed again once validated", NULL },
+  { "jobs", 'j', 0, G_OPTION_ARG_INT, &n_jobs, "Validate N files at once", "N" },
+  { "cache", 0, 0, G_OPTION_ARG_FILENAME, &cache_dir, "Reuse the results of previous validations of the same files, stored in DIR", "DIR" },
   { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &filename, NULL, "<desktop-file>..." },
   { NULL }
 };
 
+/* Prints the messages collected for a file. They are printed one by one, as
+ * desktop_file_validate() does: when a message is not valid UTF-8, g_print()
+ * escapes it on its own. */
+static void
+print_output (GString *output)
+{
+  char *message;
+  char *end;
+
+  for (message = output->str; *message != '\0'; message = end + 1) {
+    end = strchr (message, '\n');
+    if (end == NULL) {
+      g_print ("%s", message);
+      break;
+    }
+
+    *end = '\0';
+    g_print ("%s\n", message);
+  }
+}
+
+/* Results are named after a hash of everything they depend on */
+static char *
+get_cache_entry_path (const char *path,
+                      const char *contents,
+                      gsize       length)
+{
+  GChecksum *checksum;
+  guchar     flags[3];
+  char      *entry_path;
+
+  flags[0] = warn_kde;
+  flags[1] = no_warn_deprecated;
+  flags[2] = no_hints;
+
+  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_checksum_update (checksum, (const guchar *) CACHE_KEY_PREFIX,
+                     sizeof (CACHE_KEY_PREFIX));
+  g_checksum_update (checksum, flags, sizeof (flags));
+  /* messages start with the path, and some of them are about the name */
+  g_checksum_update (checksum, (const guchar *) path, strlen (path) + 1);
+  g_checksum_update (checksum, (const guchar *) contents, length);
+
+  entry_path = g_build_filename (cache_dir, g_checksum_get_string (checksum),
+                                 NULL);
+  g_checksum_free (checksum);
+
+  return entry_path;
+}
+
+static gboolean
+is_cache_entry_name (const char *name)
+{
+  int i;
+
+  for (i = 0; g_ascii_isxdigit (name[i]); i++)
+    ;
+
+  return i == 64 && name[i] == '\0';
+}
+
+/* g_file_set_contents() writes an entry to its name followed by ".XXXXXX"
+ * first */
+static gboolean
+is_cache_temp_name (const char *name)
+{
+  int i;
+
+  for (i = 0; g_ascii_isxdigit (name[i]); i++)
+    ;
+
+  return i == 64 && name[i] == '.' && strlen (name + i + 1) == 6;
+}
+
+static char *
+read_cache_entry (const char *entry_path,
+                  gsize      *length,
+                  time_t     *mtime)
+{
+  struct stat  stat_buf;
+  char        *entry;
+  ssize_t      bytes_read;
+  int          fd;
+
+  fd = g_open (entry_path, O_RDONLY, 0);
+  if (fd < 0)
+    return NULL;
+
+  if (fstat (fd, &stat_buf) < 0 || stat_buf.st_size < 2) {
+    close (fd);
+    return NULL;
+  }
+
+  entry = g_malloc (stat_buf.st_size);
+  bytes_read = read (fd, entry, stat_buf.st_size);
+  close (fd);
+
+  if (bytes_read != stat_buf.st_size) {
+    g_free (entry);
+    return NULL;
+  }
+
+  *length = bytes_read;
+  *mtime = stat_buf.st_mtime;
+
+  return entry;
+}
+
+/* An entry is "1\n" or "0\n", whether the file is valid, followed by the
+ * messages about it */
+static gboolean
+validate_file_with_cache (const char *path,
+                          GString    *output)
+{
+  char     *contents;
+  gsize     length;
+  char     *entry_path;
+  char     *entry;
+  gsize     entry_length;
+  time_t    entry_mtime;
+  gboolean  valid;
+
+  /* let the validator report why the file cannot be read */
+  if (!g_file_get_contents (path, &contents, &length, NULL))
+    return desktop_file_validate_full (path, warn_kde, no_warn_deprecated,
+                                       no_hints, output);
+
+  entry_path = get_cache_entry_path (path, contents, length);
+  entry = read_cache_entry (entry_path, &entry_length, &entry_mtime);
+
+  if (entry != NULL &&
+      (entry[0] == '0' || entry[0] == '1') && entry[1] == '\n') {
+    valid = (entry[0] == '1');
+    g_string_append_len (output, entry + 2, entry_length - 2);
+
+    if (entry_mtime < time (NULL) - CACHE_TOUCH_INTERVAL)
+      g_utime (entry_path, NULL);
+  } else {
+    GString *new_entry;
+    gsize    start;
+
+    start = output->len;
+    valid = desktop_file_validate_contents (path, contents, length, warn_kde,
+                                            no_warn_deprecated, no_hints,
+                                            output);
+
+    new_entry = g_string_new (valid ? "1\n" : "0\n");
+    g_string_append_len (new_entry, output->str + start, output->len - start);
+
+    /* the entry is written to a temporary file, renamed once complete: other
+     * runs sharing the cache never see a partial entry */
+    if (g_file_set_contents (entry_path, new_entry->str, new_entry->len, NULL))
+      g_atomic_int_set (&cache_written, TRUE);
+
+    g_string_free (new_entry, TRUE);
+  }
+
+  g_free (entry);
+  g_free (entry_path);
+  g_free (contents);
+
+  return valid;
+}
+
+static gint
+compare_cache_entries (gconstpointer a,
+                       gconstpointer b)
+{
+  const CacheEntry *entry_a = *(const CacheEntry **) a;
+  const CacheEntry *entry_b = *(const CacheEntry **) b;
+
+  if (entry_a->mtime < entry_b->mtime)
+    return -1;
+  if (entry_a->mtime > entry_b->mtime)
+    return 1;
+
+  return 0;
+}
+
+static void
+cache_entry_free (gpointer data)
+{
+  CacheEntry *entry = data;
+
+  g_free (entry->path);
+  g_free (entry);
+}
+
+/* Removes the least recently used entries if the cache is too big. Several
+ * runs can do this at once: an entry removed by another run is just not
+ * found. */
+static void
+trim_cache (void)
+{
+  GDir       *dir;
+  const char *name;
+  GPtrArray  *entries;
+  goffset     total_size;
+  time_t      now;
+  guint       i;
+
+  dir = g_dir_open (cache_dir, 0, NULL);
+  if (dir == NULL)
+    return;
+
+  entries = g_ptr_array_new_with_free_func (cache_entry_free);
+  total_size = 0;
+  now = time (NULL);
+
+  while ((name = g_dir_read_name (dir)) != NULL) {
+    CacheEntry  *entry;
+    struct stat  stat_buf;
+    char        *path;
+    goffset      size;
+
+    path = g_build_filename (cache_dir, name, NULL);
+    if (g_lstat (path, &stat_buf) < 0 || !S_ISREG (stat_buf.st_mode)) {
+      g_free (path);
+      continue;
+    }
+
+    size = (stat_buf.st_size + CACHE_BLOCK_SIZE - 1) /
+           CACHE_BLOCK_SIZE * CACHE_BLOCK_SIZE;
+
+    /* temporary files of entries being written are left behind when a run
+     * is killed: they only count until they are old enough to be sure that
+     * nobody is writing them anymore. Other files are not ours. */
+    if (is_cache_temp_name (name)) {
+      if (stat_buf.st_mtime < now - CACHE_TOUCH_INTERVAL)
+        g_unlink (path);
+      else
+        total_size += size;
+      g_free (path);
+      continue;
+    }
+
+    if (!is_cache_entry_name (name)) {
+      g_free (path);
+      continue;
+    }
+
+    entry = g_new (CacheEntry, 1);
+    entry->path = path;
+    entry->mtime = stat_buf.st_mtime;
+    entry->size = size;
+    total_size += entry->size;
+
+    g_ptr_array_add (entries, entry);
+  }
+
+  g_dir_close (dir);
+
+  if (total_size > CACHE_MAX_SIZE) {
+    g_ptr_array_sort (entries, compare_cache_entries);
+
+    for (i = 0; i < entries->len && total_size > CACHE_MAX_SIZE / 4 * 3; i++) {
+      CacheEntry *entry = g_ptr_array_index (entries, i);
+
+      g_unlink (entry->path);
+      total_size -= entry->size;
+    }
+  }
+
+  g_ptr_array_free (entries, TRUE);
+}
+
+static void
+validate_job (gpointer data,
+              gpointer user_data)
+{
+  ValidateJob  *job = data;
+  GAsyncQueue  *done = user_data;
+
+  job->exists = g_file_test (job->filename, G_FILE_TEST_IS_REGULAR);
+  if (job->exists && cache_dir != NULL)
+    job->valid = validate_file_with_cache (job->filename, job->output);
+  else if (job->exists)
+    job->valid = desktop_file_validate_full (job->filename, warn_kde,
+                                             no_warn_deprecated, no_hints,
+                                             job->output);
+
+  if (drop_cache)
+    dfu_file_advise_dont_need (job->filename);
+
+  g_async_queue_push (done, job);
+}
+
+/* Validates the files in a pool of n_jobs threads. The messages about each
+ * file are collected, and printed at once, in the order of the files, so
+ * that the output is the same as when validating one file after the
+ * other. */
+static gboolean
+validate_files_in_parallel (void)
+{
+  ValidateJob *jobs;
+  GThreadPool *pool;
+  GAsyncQueue *done;
+  GError      *error;
+  gboolean     all_valid;
+  guint        n_files, n_queued, n_printed, i;
+
+  n_files = g_strv_length (filename);
+  jobs = g_new0 (ValidateJob, n_files);
+
+#if !GLIB_CHECK_VERSION (2, 32, 0)
+  if (!g_thread_supported ())
+    g_thread_init (NULL);
+#endif
+
+  done = g_async_queue_new ();
+
+  error = NULL;
+  pool = g_thread_pool_new (validate_job, done, n_jobs, TRUE, &error);
+  if (pool == NULL) {
+    g_printerr ("Could not start threads: %s\n", error->message);
+    g_error_free (error);
+    g_async_queue_unref (done);
+    g_free (jobs);
+    return FALSE;
+  }
+
+  all_valid = TRUE;
+  n_queued = 0;
+  n_printed = 0;
+
+  while (n_printed < n_files) {
+    ValidateJob *job;
+
+    for (; n_queued < n_files &&
+           n_queued < n_printed + n_jobs * QUEUED_FILES_PER_JOB; n_queued++) {
+      jobs[n_queued].filename = filename[n_queued];
+      jobs[n_queued].output = g_string_new (NULL);
+      g_thread_pool_push (pool, &jobs[n_queued], NULL);
+    }
+
+    job = g_async_queue_pop (done);
+    job->done = TRUE;
+
+    for (i = n_printed; i < n_queued && jobs[i].done; i++) {
+      job = &jobs[i];
+
+      if (!job->exists) {
+        g_printerr ("%s: file does not exist\n", job->filename);
+        all_valid = FALSE;
+      } else if (!job->valid)
+        all_valid = FALSE;
+
+      print_output (job->output);
+      g_string_free (job->output, TRUE);
+    }
+    n_printed = i;
+  }
+
+  g_thread_pool_free (pool, FALSE, TRUE);
+  g_async_queue_unref (done);
+  g_free (jobs);
+
+  return all_valid;
+}
+
+static gboolean
+validate_files (void)
+{
+  gboolean all_valid;
+  int      i, ahead;
+
+  all_valid = TRUE;
+  ahead = 0;
+  for (i = 0; filename[i]; i++) {
+    /* keep the disk busy with the next files while parsing this one */
+    for (; filename[ahead] && ahead <= i + READAHEAD_FILES; ahead++)
+      dfu_file_advise_will_need (filename[ahead]);
+
+    if (!g_file_test (filename[i], G_FILE_TEST_IS_REGULAR)) {
+      g_printerr ("%s: file does not exist\n", filename[i]);
+      all_valid = FALSE;
+    } else if (cache_dir != NULL) {
+      GString *output;
+
+      output = g_string_new (NULL);
+      if (!validate_file_with_cache (filename[i], output))
+        all_valid = FALSE;
+
+      print_output (output);
+      g_string_free (output, TRUE);
+    } else if (!desktop_file_validate (filename[i], warn_kde, no_warn_deprecated, no_hints))
+      all_valid = FALSE;
+
+    if (drop_cache)
+      dfu_file_advise_dont_need (filename[i]);
+  }
+
+  return all_valid;
+}
+
 int
 main (int argc, char *argv[])
 {
   GOptionContext *context;
   GError         *error;
-  int i;
   gboolean all_valid;
 
   context = g_option_context_new (NULL);
@@ -73,15 +520,25 @@ main (int argc, char *argv[])
     return 1;
   }
 
-  all_valid = TRUE;
-  for (i = 0; filename[i]; i++) {
-    if (!g_file_test (filename[i], G_FILE_TEST_IS_REGULAR)) {
-      g_printerr ("%s: file does not exist\n", filename[i]);
-      all_valid = FALSE;
-    } else if (!desktop_file_validate (filename[i], warn_kde, no_warn_deprecated, no_hints))
-      all_valid = FALSE;
+  if (n_jobs < 1) {
+    g_printerr ("The number of jobs must be at least 1\n");
+    return 1;
   }
 
+  if (cache_dir != NULL && g_mkdir_with_parents (cache_dir, 0755) < 0) {
+    g_printerr ("Could not create cache directory \"%s\": %s\n",
+                cache_dir, g_strerror (errno));
+    return 1;
+  }
+
+  if (n_jobs > 1 && filename[1] != NULL)
+    all_valid = validate_files_in_parallel ();
+  else
+    all_valid = validate_files ();
+
+  if (cache_written)
+    trim_cache ();
+
   if (!all_valid)
     return 1;
 